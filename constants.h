@@ -10,9 +10,63 @@
 
 #define DEFAULT_LOGFILE "/var/log/tb/l3af/ratelimiting.log"
 
-#define MAP_COUNT	5
 #define MAX_PORTS       50
 
+/* Map FDs are sequenced same as they are defined in the bpf program */
+enum rl_map_idx {
+    RL_CONFIG_MAP = 0,
+    RL_WINDOW_MAP,
+    RL_RECV_COUNT_MAP,
+    RL_DROP_COUNT_MAP,
+    RL_PORTS_MAP,
+    RL_NEXT_PROG_MAP,
+    RL_GCRA_MAP,
+    RL_EWMA_MAP,
+    RL_RETRANS_MAP,
+    RL_RETRANS_COUNT_MAP,
+    RL_SYN_FLOW_MAP,
+    RL_REPUTATION_MAP,
+    RL_PORT_STATS_MAP,
+    RL_HALFOPEN_MAP,
+    RL_CONN_MAP,
+    RL_VIP_CONN_MAP,
+    RL_RST_BUCKET_MAP,
+    RL_RST_COUNT_MAP,
+    RL_MARK_FLOW_MAP,
+    RL_MARK_COUNT_MAP,
+    RL_DSCP_CLASS_MAP,
+    RL_REDIRECT_DEV_MAP,
+    RL_REDIRECT_CPU_MAP,
+    RL_REDIRECT_CPUS_MAP,
+    RL_REDIRECT_COUNT_MAP,
+    RL_QUIC_PORTS_MAP,
+    RL_PROTO_STATS_MAP,
+    RL_CLASS_POLICY_MAP,
+    RL_CLASS_WINDOW_MAP,
+    RL_CLASS_STATS_MAP,
+    RL_FP_MAP,
+    RL_FP_LIMIT_MAP,
+    RL_QUEUE_STATS_MAP,
+    RL_HOT_MAP,
+    RL_XSK_MAP,
+    RL_XSK_COUNT_MAP,
+    MAP_COUNT
+};
+
+/* Map FDs of the cgroup program */
+enum rl_cgroup_map_idx {
+    RL_CGROUP_STORAGE_MAP = 0,
+    CGROUP_MAP_COUNT
+};
+
+/* Map FDs of the reuseport program */
+enum rl_reuseport_map_idx {
+    RL_REUSEPORT_CONFIG_MAP = 0,
+    RL_REUSEPORT_SOCKS_MAP,
+    RL_WORKER_MAP,
+    REUSEPORT_MAP_COUNT
+};
+
 /* Path at which BPF maps are pinned */
 const char *pin_basedir = "/sys/fs/bpf";
 const char *pin_subdir	= "ratelimiting";
@@ -37,10 +91,71 @@ const char *xdp_prog = "/sys/fs/bpf/ratelimiting/xdp_ratelimiting";
 /* XDP program that is next in the chain */
 const char *xdp_rl_ingress_next_prog = "/sys/fs/bpf/xdp_rl_ingress_next_prog";
 
+/* Reuseport program and the map of the sockets of its workers, pinned for
+ * the services */
+const char *reuseport_prog = "/sys/fs/bpf/ratelimiting/ratelimiting_reuseport";
+const char *reuseport_socks_map =
+    "/sys/fs/bpf/ratelimiting/rl_reuseport_socks_map";
+
+/* Name of the next program map pinned per instance, when more than one
+ * interface is managed */
+const char *next_prog_pin_name = "xdp_rl_ingress_next_prog";
+
+/* Priority and handle of the tc filter recording the SYN-ACKs at the egress
+ * of the interfaces */
+#define SYNACK_TC_PRIO          0x726c      /* "rl" */
+#define SYNACK_TC_HANDLE        1
+
+/* Interfaces managed by one daemon */
+#define MAX_INSTANCES           16
+
+/* Cgroups limited by one daemon */
+#define MAX_CGROUPS             64
+
+/* Interval(in sec) of the periodic cleanup and statistics */
+#define STATS_INTERVAL          60
+
+/* Quota sync between the daemons of a fleet */
+#define MAX_SYNC_PEERS          64
+#define SYNC_MAGIC              0x726c7371  /* "rlsq" */
+#define SYNC_VERSION            2
+/* Sync intervals without a report after which a peer is considered silent */
+#define SYNC_TIMEOUT_INTERVALS  3
+/* Percentage of the budget split evenly between the live hosts, so a host
+ * without demand still admits its first SYNs */
+#define SYNC_SHARE_FLOOR        10
+
+/* Limits at the start of the ramp by default, in percent of the rate */
+#define RAMP_FLOOR_PERCENT      10
+
+/* Number of keys over the limit in the periodic log */
+#define HOT_KEYS_TOP            10
+
+/* Keys read per batch by the exports */
+#define EXPORT_BATCH            4096
+
+/* Number of records of the dumps by default */
+#define DUMP_TOP_DEFAULT        20
+
 /* Buffer time(in sec) to hold the map elements, after which they get deleted */
 const int buffer_time = 10;
 
+/* Queue size of the CPUs of the redirect CPU set */
+#define REDIRECT_CPU_QSIZE      2048
+
+/* IANA assigned VXLAN port */
+#define VXLAN_PORT_DEFAULT      4789
+
+/* Number of fingerprints in the top fingerprints log by default */
+#define FP_TOP_DEFAULT          10
+
+/* Separates the option kinds of a fingerprint */
+const char fp_opt_delim[] = "-";
+
 /* Port separator */
 const char delim[] = ",";
 
+/* Separates a port from its action and the fields of a traffic class */
+const char action_delim[] = ":";
+
 #endif
@@ -0,0 +1,536 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* AF_XDP engine running the limiter in user space, for the hosts where the
+ * XDP program can't be chained and for the SYNs the XDP program hands over
+ * with the xsk action. One thread per RX queue reads the frames in
+ * batches, decides on the SYNs with the sliding window of the XDP program,
+ * after the limit per source if any, and transmits the admitted frames on
+ * the output interface. */
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/types.h>
+
+extern "C" {
+#include "bpf/libbpf.h"
+#include "bpf/xsk.h"
+}
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#include "ratelimiting_common.h"
+#include "ratelimiting_limiter.hpp"
+
+/* Frames of the UMEM of a socket, twice the ring size so the TX ring can
+ * be kept full while the kernel completes the frames sent */
+#define NUM_FRAMES      (2 * XSK_RING_PROD__DEFAULT_NUM_DESCS)
+#define FRAME_SIZE      XSK_UMEM__DEFAULT_FRAME_SIZE
+
+/* Frames read per ring access */
+#define BATCH_DEFAULT   64
+#define BATCH_MAX       256
+
+/* Time(in ms) an idle queue thread waits for frames */
+#define POLL_TIMEOUT    100
+
+/* Time(in sec) after which an idle source is forgotten */
+#define SOURCE_IDLE     10
+
+static const char *__doc__ =
+        "Ratelimit incoming TCP connections using AF_XDP";
+
+/* UMEM and rings of an AF_XDP socket bound to one queue */
+struct xsk_port {
+    struct xsk_umem *umem = NULL;
+    struct xsk_socket *xsk = NULL;
+    struct xsk_ring_prod fill;
+    struct xsk_ring_cons comp;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    void *area = NULL;
+    std::vector<__u64> free_frames;     /* TX frames not in flight */
+};
+
+/* Counters of a queue thread, written by that thread only */
+struct alignas(64) queue_stats {
+    std::atomic<__u64> frames{0};
+    std::atomic<__u64> syns{0};
+    std::atomic<__u64> drops{0};
+    std::atomic<__u64> sent{0};
+    std::atomic<__u64> tx_full{0};      /* Admitted, dropped as TX was full */
+};
+
+static const char *ifname, *out_ifname, *xsk_map;
+static int nr_queues = 1, batch = BATCH_DEFAULT, interval = 1;
+static __u64 rate, source_limit;
+static __u32 xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST;
+static __u16 bind_flags;
+
+static std::vector<xsk_port> rx_ports, tx_ports;
+static std::unique_ptr<queue_stats[]> stats;
+static std::atomic<bool> stop{false};
+
+/* Id of the redirect program libbpf attached to the input interface, 0
+ * when a program was there already */
+static __u32 xdp_prog_id;
+
+/* The window is shared by the queues, as rl_window_map is by the CPUs. The
+ * threads race on it, so unlike struct rl_window its state is atomic. */
+struct alignas(64) shared_window {
+    std::atomic<__u64> start{0};
+    std::atomic<__u64> prev{0};
+    std::atomic<__u64> curr{0};
+};
+
+static shared_window window;
+
+/* GCRA per source address, looked up by the queue threads without a
+ * lock */
+typedef rl::limiter<rl::gcra, __u32, std::hash<__u32>,
+                    rl::concurrent_table<__u32, uint64_t>> source_limiter;
+static std::unique_ptr<source_limiter> per_source;
+
+static const struct option long_options[] = {
+    {"help",      no_argument,        NULL, 'h' },
+    {"iface",     required_argument,  NULL, 'i' },
+    {"out-iface", required_argument,  NULL, 'o' },
+    {"queues",    required_argument,  NULL, 'q' },
+    {"rate",      required_argument,  NULL, 'r' },
+    {"batch",     required_argument,  NULL, 'b' },
+    {"copy",      no_argument,        NULL, 'c' },
+    {"skb",       no_argument,        NULL, 's' },
+    {"xsk-map",   required_argument,  NULL, 'x' },
+    {"interval",  required_argument,  NULL, 'I' },
+    {"source-limit", required_argument, NULL, 'S' },
+    {0,           0,                  NULL,  0  }
+};
+
+static void usage(char *argv[])
+{
+    int i;
+    printf("\nDOCUMENTATION:\n%s\n", __doc__);
+    printf("\n");
+    printf(" Usage: %s (options-see-below)\n", argv[0]);
+    printf(" Listing options:\n");
+    for (i = 0; long_options[i].name != 0; i++)
+        printf(" --%-12s short-option: -%c\n", long_options[i].name,
+               long_options[i].val);
+    printf("\n");
+}
+
+static __u64 time_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Create the UMEM and the socket of a queue, with an RX ring for the input
+ * interface and a TX ring for the output one. Only the input socket may
+ * load the redirect program of libbpf, the XDP program of the limiter
+ * redirects to the sockets itself with --xsk-map. */
+static int open_port(xsk_port &port, const char *name, __u32 queue, bool rx)
+{
+    struct xsk_umem_config umem_config = {
+        XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        FRAME_SIZE,
+        XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+    };
+    struct xsk_socket_config config;
+    __u32 idx, i;
+
+    if (posix_memalign(&port.area, getpagesize(), NUM_FRAMES * FRAME_SIZE)) {
+        fprintf(stderr, "failed to allocate the frames of %s\n", name);
+        return -1;
+    }
+    if (xsk_umem__create(&port.umem, port.area, NUM_FRAMES * FRAME_SIZE,
+                         &port.fill, &port.comp, &umem_config)) {
+        fprintf(stderr, "failed to create the UMEM of %s\n", name);
+        return -1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    config.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    config.libbpf_flags = rx && !xsk_map ? 0 :
+        XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
+    config.xdp_flags = xdp_flags;
+    config.bind_flags = bind_flags;
+    if (xsk_socket__create(&port.xsk, name, queue, port.umem,
+                           rx ? &port.rx : NULL, rx ? NULL : &port.tx,
+                           &config)) {
+        fprintf(stderr, "failed to bind to queue %u of %s: %s\n", queue,
+                name, strerror(errno));
+        return -1;
+    }
+
+    if (!rx) {
+        for (i = 0; i < NUM_FRAMES; i++)
+            port.free_frames.push_back((__u64)i * FRAME_SIZE);
+        return 0;
+    }
+    /* Hand the kernel a full ring of frames to receive in */
+    if (xsk_ring_prod__reserve(&port.fill, XSK_RING_PROD__DEFAULT_NUM_DESCS,
+                               &idx) != XSK_RING_PROD__DEFAULT_NUM_DESCS)
+        return -1;
+    for (i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS; i++)
+        *xsk_ring_prod__fill_addr(&port.fill, idx + i) = (__u64)i * FRAME_SIZE;
+    xsk_ring_prod__submit(&port.fill, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    return 0;
+}
+
+static void close_port(xsk_port &port)
+{
+    if (port.xsk)
+        xsk_socket__delete(port.xsk);
+    if (port.umem)
+        xsk_umem__delete(port.umem);
+    free(port.area);
+}
+
+/* The limiter decides on the SYNs, the other frames are passed. The
+ * source address of a SYN is returned in saddr. */
+static bool rl_syn(const __u8 *pkt, __u32 len, __u32 *saddr)
+{
+    const struct ethhdr *eth = (const struct ethhdr *)pkt;
+    const struct iphdr *iph = (const struct iphdr *)(eth + 1);
+    const struct tcphdr *tcph;
+
+    if (len < sizeof(*eth) + sizeof(*iph) || eth->h_proto != htons(ETH_P_IP) ||
+        iph->protocol != IPPROTO_TCP || iph->ihl < 5)
+        return false;
+    if (len < sizeof(*eth) + iph->ihl * 4 + sizeof(*tcph))
+        return false;
+    tcph = (const struct tcphdr *)((const __u8 *)iph + iph->ihl * 4);
+    *saddr = iph->saddr;
+    return tcph->syn && !tcph->ack;
+}
+
+/* Sliding window decision of rl_window_admit on the shared window. The
+ * first thread to see a new window rolls it with a compare-and-swap of its
+ * start, the SYNs counted in between the roll of the start and of the
+ * counters go to the previous window. */
+static bool window_admit(__u64 tnow, __u64 limit)
+{
+    __u64 start = tnow / RL_NANO * RL_NANO;
+    __u64 seen = window.start.load(std::memory_order_acquire);
+
+    if (seen < start &&
+        window.start.compare_exchange_strong(seen, start,
+                                             std::memory_order_acq_rel)) {
+        __u64 last = window.curr.exchange(0, std::memory_order_acq_rel);
+
+        /* The previous window counts only when adjacent */
+        window.prev.store(seen + RL_NANO == start ? last : 0,
+                          std::memory_order_release);
+    }
+
+    __u64 pw_weight = 100 - ((tnow - start) * 100) / RL_NANO;
+    if (window.prev.load(std::memory_order_relaxed) * pw_weight +
+        window.curr.load(std::memory_order_relaxed) * 100 > limit * 100)
+        return false;
+
+    window.curr.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+/* Put the frames sent by the kernel back in the free list */
+static void complete_tx(xsk_port &port)
+{
+    __u32 idx, i;
+    size_t n;
+
+    n = xsk_ring_cons__peek(&port.comp, NUM_FRAMES, &idx);
+    for (i = 0; i < n; i++)
+        port.free_frames.push_back(*xsk_ring_cons__comp_addr(&port.comp,
+                                                             idx + i));
+    xsk_ring_cons__release(&port.comp, n);
+}
+
+/* Loop of the thread of a queue: decide on a batch of received frames,
+ * copy the admitted ones to the output UMEM, give the received frames
+ * back to the fill ring and kick the transmission */
+static void run_queue(int queue)
+{
+    xsk_port &rx = rx_ports[queue], &tx = tx_ports[queue];
+    queue_stats &st = stats[queue];
+    struct pollfd pfd = { xsk_socket__fd(rx.xsk), POLLIN, 0 };
+    __u32 admitted[BATCH_MAX];
+    __u32 idx_rx, idx_fill, idx_tx, i;
+    __u64 syns, drops, tnow;
+    size_t n, nr_tx, want, slots;
+    __u32 saddr;
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        complete_tx(tx);
+        n = xsk_ring_cons__peek(&rx.rx, batch, &idx_rx);
+        if (!n) {
+            poll(&pfd, 1, POLL_TIMEOUT);
+            continue;
+        }
+
+        /* One timestamp per batch, as the window has a 1 sec resolution */
+        tnow = time_get_ns();
+        syns = drops = nr_tx = 0;
+        for (i = 0; i < n; i++) {
+            const struct xdp_desc *desc =
+                xsk_ring_cons__rx_desc(&rx.rx, idx_rx + i);
+            const __u8 *pkt =
+                (const __u8 *)xsk_umem__get_data(rx.area, desc->addr);
+
+            if (rl_syn(pkt, desc->len, &saddr)) {
+                syns++;
+                /* A source over its limit doesn't use the shared budget */
+                if ((per_source && !per_source->admit(saddr, tnow)) ||
+                    !window_admit(tnow, rate)) {
+                    drops++;
+                    continue;
+                }
+            }
+            admitted[nr_tx++] = i;
+        }
+
+        /* The admitted frames without a TX slot or frame are dropped */
+        want = std::min(nr_tx, tx.free_frames.size());
+        slots = want ? xsk_ring_prod__reserve(&tx.tx, want, &idx_tx) : 0;
+        for (i = 0; i < slots; i++) {
+            const struct xdp_desc *desc =
+                xsk_ring_cons__rx_desc(&rx.rx, idx_rx + admitted[i]);
+            struct xdp_desc *out = xsk_ring_prod__tx_desc(&tx.tx, idx_tx + i);
+
+            out->addr = tx.free_frames.back();
+            out->len = desc->len;
+            tx.free_frames.pop_back();
+            memcpy(xsk_umem__get_data(tx.area, out->addr),
+                   xsk_umem__get_data(rx.area, desc->addr), desc->len);
+        }
+        if (slots) {
+            xsk_ring_prod__submit(&tx.tx, slots);
+            /* Copy mode transmits from the sendmsg path */
+            sendto(xsk_socket__fd(tx.xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+        }
+
+        /* All the received frames were copied or dropped, they go back to
+         * the kernel. The fill ring has room for them, as no more than a
+         * ring of frames is used for receiving. */
+        while (xsk_ring_prod__reserve(&rx.fill, n, &idx_fill) != n)
+            ;
+        for (i = 0; i < n; i++)
+            *xsk_ring_prod__fill_addr(&rx.fill, idx_fill + i) =
+                xsk_ring_cons__rx_desc(&rx.rx, idx_rx + i)->addr;
+        xsk_ring_prod__submit(&rx.fill, n);
+        xsk_ring_cons__release(&rx.rx, n);
+
+        st.frames.fetch_add(n, std::memory_order_relaxed);
+        st.syns.fetch_add(syns, std::memory_order_relaxed);
+        st.drops.fetch_add(drops, std::memory_order_relaxed);
+        st.sent.fetch_add(slots, std::memory_order_relaxed);
+        st.tx_full.fetch_add(nr_tx - slots, std::memory_order_relaxed);
+    }
+}
+
+static void signal_handler(int signal)
+{
+    stop.store(true);
+}
+
+/* Register the sockets in the map of the XDP program of the limiter, which
+ * redirects the SYNs of the xsk action to the socket of their queue */
+static int register_sockets(bool add)
+{
+    int fd, sock_fd, ret = 0;
+    __u32 queue;
+
+    fd = bpf_obj_get(xsk_map);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open %s\n", xsk_map);
+        return -1;
+    }
+    for (queue = 0; queue < (__u32)nr_queues; queue++) {
+        sock_fd = xsk_socket__fd(rx_ports[queue].xsk);
+        if (add ? bpf_map_update_elem(fd, &queue, &sock_fd, 0) :
+                  bpf_map_delete_elem(fd, &queue)) {
+            fprintf(stderr, "failed to update %s for queue %u\n", xsk_map,
+                    queue);
+            ret = -1;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+/* Frames, SYNs and drops per second of all the queues */
+static void print_stats(__u64 *prev, double secs)
+{
+    __u64 curr[5] = { 0 };
+    int q, i;
+
+    for (q = 0; q < nr_queues; q++) {
+        curr[0] += stats[q].frames.load(std::memory_order_relaxed);
+        curr[1] += stats[q].syns.load(std::memory_order_relaxed);
+        curr[2] += stats[q].drops.load(std::memory_order_relaxed);
+        curr[3] += stats[q].sent.load(std::memory_order_relaxed);
+        curr[4] += stats[q].tx_full.load(std::memory_order_relaxed);
+    }
+    printf("frames %.0f/s SYNs %.0f/s dropped %.0f/s sent %.0f/s "
+           "TX full %.0f/s\n", (curr[0] - prev[0]) / secs,
+           (curr[1] - prev[1]) / secs, (curr[2] - prev[2]) / secs,
+           (curr[3] - prev[3]) / secs, (curr[4] - prev[4]) / secs);
+    fflush(stdout);
+    for (i = 0; i < 5; i++)
+        prev[i] = curr[i];
+}
+
+int main(int argc, char **argv)
+{
+    struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+    std::vector<std::thread> threads;
+    int longindex = 0, opt, q, ifindex, ret = EXIT_SUCCESS;
+    __u64 prev[5] = { 0 }, last;
+    __u32 prev_id = 0, id = 0;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options,
+                              &longindex)) != -1) {
+        switch (opt) {
+            case 'i':
+                ifname = optarg;
+                break;
+            case 'o':
+                out_ifname = optarg;
+                break;
+            case 'q':
+                nr_queues = atoi(optarg);
+                break;
+            case 'r':
+                rate = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            case 'c':
+                bind_flags |= XDP_COPY;
+                break;
+            case 's':
+                xdp_flags |= XDP_FLAGS_SKB_MODE;
+                break;
+            case 'x':
+                xsk_map = optarg;
+                break;
+            case 'I':
+                interval = atoi(optarg);
+                break;
+            case 'S':
+                source_limit = strtoull(optarg, NULL, 10);
+                break;
+            case 'h':
+            default:
+                usage(argv);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!ifname || !out_ifname || !rate || nr_queues <= 0 ||
+        nr_queues > RL_MAX_QUEUES || batch <= 0 || batch > BATCH_MAX ||
+        interval <= 0) {
+        usage(argv);
+        return EXIT_FAILURE;
+    }
+    if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+        perror("setrlimit(RLIMIT_MEMLOCK)");
+        return EXIT_FAILURE;
+    }
+    ifindex = if_nametoindex(ifname);
+    if (!ifindex ||
+        (!xsk_map && bpf_get_link_xdp_id(ifindex, &prev_id, xdp_flags))) {
+        fprintf(stderr, "failed to query the XDP program of %s\n", ifname);
+        return EXIT_FAILURE;
+    }
+
+    /* Queue q of the input interface is forwarded to queue q of the output
+     * one. The UMEM can't be shared across devices, so the admitted frames
+     * are copied. */
+    if (source_limit)
+        per_source.reset(new source_limiter(source_limit));
+    rx_ports.resize(nr_queues);
+    tx_ports.resize(nr_queues);
+    stats.reset(new queue_stats[nr_queues]);
+    for (q = 0; q < nr_queues; q++) {
+        int failed = open_port(rx_ports[q], ifname, q, true);
+
+        /* The first input socket attaches the redirect program of libbpf,
+         * unless one was there */
+        if (!xsk_map && !xdp_prog_id &&
+            !bpf_get_link_xdp_id(ifindex, &id, xdp_flags) && id != prev_id)
+            xdp_prog_id = id;
+        if (failed || open_port(tx_ports[q], out_ifname, q, false)) {
+            ret = EXIT_FAILURE;
+            goto cleanup;
+        }
+    }
+    if (xsk_map && register_sockets(true)) {
+        ret = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);
+
+    for (q = 0; q < nr_queues; q++)
+        threads.emplace_back(run_queue, q);
+
+    last = time_get_ns();
+    while (!stop.load()) {
+        sleep(interval);
+        __u64 now = time_get_ns();
+
+        print_stats(prev, (double)(now - last) / RL_NANO);
+        last = now;
+        if (per_source)
+            per_source->expire(SOURCE_IDLE * RL_NANO);
+    }
+    for (auto &t : threads)
+        t.join();
+    if (xsk_map)
+        register_sockets(false);
+
+cleanup:
+    for (q = 0; q < (int)rx_ports.size(); q++) {
+        close_port(rx_ports[q]);
+        close_port(tx_ports[q]);
+    }
+    /* Remove the redirect program libbpf attached to the input interface,
+     * unless it was replaced since */
+    if (xdp_prog_id && !bpf_get_link_xdp_id(ifindex, &id, xdp_flags) &&
+        id == xdp_prog_id)
+        bpf_set_link_xdp_fd(ifindex, -1, xdp_flags);
+    return ret;
+}
@@ -0,0 +1,166 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Benchmark of the export of rl_hot_map. A per CPU LRU hash is created and
+ * filled with the keys of the table, then read back with the export of the
+ * daemon: the walk of the keys with one lookup per key and, when built
+ * with HAVE_BPF_MAP_BATCH, the batched reads. The time spent reducing the
+ * values of the CPUs is measured within each read. Needs root.
+ *
+ * Usage: ratelimiting_bench [keys] [rounds] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <linux/bpf.h>
+#include <linux/types.h>
+
+#include "bpf_util.h"
+#include "bpf/bpf.h"
+
+#include "constants.h"
+#include "ratelimiting_common.h"
+#include "ratelimiting_reduce.h"
+
+static __u64 time_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Reduction of the batches, as in the export of the hot keys */
+struct reduce_run {
+    __u64 reduce_ns;
+    __u64 check;
+};
+
+static void reduce_batch(const void *keys, const void *values, __u32 count,
+                         void *arg)
+{
+    unsigned int nr_cpus = bpf_num_possible_cpus();
+    const struct rl_hot_key *percpu = values;
+    struct reduce_run *run = arg;
+    __u64 start = time_get_ns();
+    struct rl_hot_key hot;
+    __u32 n;
+
+    for (n = 0; n < count; n++) {
+        rl_reduce_hot_key(&percpu[n * nr_cpus], nr_cpus,
+                          ((const __u32 *)keys)[n], &hot);
+        run->check += hot.drops;
+    }
+    run->reduce_ns += time_get_ns() - start;
+}
+
+typedef int (*read_fn)(int fd, __u32 key_size, __u32 value_size,
+                       percpu_batch_cb cb, void *arg, char *keys,
+                       char *values);
+
+/* Best of rounds reads of the map, returns -1 when a read fails */
+static int bench(const char *name, read_fn read_keys, int fd, int rounds,
+                 unsigned long nr_keys, __u64 expected)
+{
+    char *keys = malloc((size_t)EXPORT_BATCH * sizeof(__u32));
+    char *values = malloc(EXPORT_BATCH *
+                          rl_percpu_stride(sizeof(struct rl_hot_key)));
+    __u64 best = ~0ULL, best_reduce = 0, start, ns;
+    struct reduce_run run;
+    int r, ret = -1;
+
+    if (!keys || !values)
+        goto out;
+    for (r = 0; r < rounds; r++) {
+        run.reduce_ns = 0;
+        run.check = 0;
+        start = time_get_ns();
+        if (read_keys(fd, sizeof(__u32), sizeof(struct rl_hot_key),
+                      reduce_batch, &run, keys, values) != (int)nr_keys) {
+            fprintf(stderr, "%s: failed to read the %lu keys\n", name,
+                    nr_keys);
+            goto out;
+        }
+        ns = time_get_ns() - start;
+        if (run.check != expected) {
+            fprintf(stderr, "%s: reduction differs\n", name);
+            goto out;
+        }
+        if (ns < best) {
+            best = ns;
+            best_reduce = run.reduce_ns;
+        }
+    }
+    printf("%-10s %8.1f ms  %6.2f M keys/s  reduction %.1f ms\n", name,
+           best / 1e6, (double)nr_keys / best * 1e3, best_reduce / 1e6);
+    ret = 0;
+out:
+    free(keys);
+    free(values);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long nr_keys = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    unsigned int nr_cpus = bpf_num_possible_cpus(), cpu;
+    struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+    struct rl_hot_key *values;
+    __u64 expected = 0;
+    int fd, ret = EXIT_FAILURE;
+    __u32 key;
+
+    if (!nr_keys || nr_keys > INT_MAX / 2 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [keys] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+        perror("setrlimit(RLIMIT_MEMLOCK)");
+        return EXIT_FAILURE;
+    }
+    /* Twice the size of the table, the LRU evicts before it is full */
+    fd = bpf_create_map(BPF_MAP_TYPE_LRU_PERCPU_HASH, sizeof(__u32),
+                        sizeof(struct rl_hot_key), 2 * nr_keys, 0);
+    values = calloc(nr_cpus, sizeof(*values));
+    if (fd < 0 || !values) {
+        perror("bpf_create_map");
+        goto out;
+    }
+
+    /* 1 slot in 16 is left over by another key */
+    srand(1);
+    for (key = 0; key < nr_keys; key++) {
+        for (cpu = 0; cpu < nr_cpus; cpu++) {
+            values[cpu].key = rand() % 16 ? key : ~key;
+            values[cpu].drops = rand() % 1000;
+            values[cpu].last_seen = rand();
+            if (values[cpu].key == key)
+                expected += values[cpu].drops;
+        }
+        if (bpf_map_update_elem(fd, &key, values, BPF_NOEXIST)) {
+            perror("bpf_map_update_elem");
+            goto out;
+        }
+    }
+
+    printf("%lu keys x %u CPUs, best of %d rounds\n", nr_keys, nr_cpus,
+           rounds);
+    if (bench("key walk", rl_read_percpu_keys, fd, rounds, nr_keys,
+              expected))
+        goto out;
+#ifdef HAVE_BPF_MAP_BATCH
+    if (bench("batched", rl_read_percpu_batch, fd, rounds, nr_keys,
+              expected))
+        goto out;
+#endif
+    ret = EXIT_SUCCESS;
+out:
+    free(values);
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
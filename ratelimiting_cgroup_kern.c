@@ -0,0 +1,69 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Ratelimit the connections accepted by the sockets of a cgroup. Attached
+ * to the ingress of the cgroups of the services, it sees the SYNs after
+ * DNAT when they reach the listening socket, which the XDP program on the
+ * NIC can't tell apart. */
+
+#define KBUILD_MODNAME "foo"
+
+#include <uapi/linux/bpf.h>
+#include <uapi/linux/if_ether.h>
+#include <uapi/linux/ip.h>
+#include <uapi/linux/in.h>
+#include <uapi/linux/tcp.h>
+
+#include "bpf_helpers.h"
+#include "bpf_endian.h"
+
+#include "ratelimiting_common.h"
+#include "ratelimiting_window.h"
+
+/* Verdicts of the cgroup skb programs */
+#define CGROUP_DROP     0
+#define CGROUP_PASS     1
+
+/* Limit and window of each cgroup the program is attached to */
+struct bpf_map_def SEC("maps") rl_cgroup_storage = {
+	.type		= BPF_MAP_TYPE_CGROUP_STORAGE,
+	.key_size	= sizeof(struct bpf_cgroup_storage_key),
+	.value_size	= sizeof(struct rl_cgroup_state),
+	.max_entries	= 0,
+};
+
+SEC("cgroup/skb")
+int _cgroup_ratelimiting(struct __sk_buff *skb)
+{
+    struct rl_cgroup_state *state;
+    struct tcphdr tcph;
+    struct iphdr iph;
+
+    if (skb->protocol != bpf_htons(ETH_P_IP))
+        return CGROUP_PASS;
+
+    /* The packet starts at the IP header at the socket */
+    if (bpf_skb_load_bytes(skb, 0, &iph, sizeof(iph)) ||
+        iph.protocol != IPPROTO_TCP)
+        return CGROUP_PASS;
+    if (bpf_skb_load_bytes(skb, iph.ihl * 4, &tcph, sizeof(tcph)))
+        return CGROUP_PASS;
+
+    /* Only the passive opens */
+    if (!tcph.syn || tcph.ack)
+        return CGROUP_PASS;
+
+    state = bpf_get_local_storage(&rl_cgroup_storage, 0);
+    if (!state->limit)
+        return CGROUP_PASS;
+
+    __sync_fetch_and_add(&state->syns, 1);
+    if (rl_window_admit(&state->window, bpf_ktime_get_ns(), state->limit,
+                        1) != XDP_PASS) {
+        __sync_fetch_and_add(&state->drops, 1);
+        return CGROUP_DROP;
+    }
+    return CGROUP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,341 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Definitions shared between the XDP program and the user space program */
+
+#ifndef RATELIMITING_COMMON_H
+#define RATELIMITING_COMMON_H
+
+/* Used for second to nanoseconds conversions and vice-versa */
+#define RL_NANO 1000000000ULL
+
+/* Default size of the per-key state tables, can be changed with --max-keys */
+#define RL_MAX_KEYS_DEFAULT 1048576
+
+/* Indices of the values stored in rl_config_map */
+enum rl_config_idx {
+    RL_CONFIG_RATE = 0,         /* Connections per second */
+    RL_CONFIG_MODE,             /* Limiter algorithm, one of enum rl_mode */
+    RL_CONFIG_KEY_MASK,         /* Source address mask(network order) used
+                                 * to form the per-key state key */
+    RL_CONFIG_GCRA_INTERVAL,    /* GCRA emission interval in ns(1s / rate) */
+    RL_CONFIG_GCRA_TOLERANCE,   /* GCRA burst tolerance in ns */
+    RL_CONFIG_EWMA_SHIFT,       /* EWMA half-life as a power of two of
+                                 * RL_EWMA_TS_SHIFT time units */
+    RL_CONFIG_EWMA_LIMIT,       /* EWMA estimate above which a key is over
+                                 * its rate */
+    RL_CONFIG_EWMA_SCORE,       /* Maintain the EWMA score in other modes and
+                                 * keep keys above the limit out of the budget */
+    RL_CONFIG_PRIORITY_HEADROOM,/* Connections per second admitted above the
+                                 * rate for priority connections */
+    RL_CONFIG_EWMA_HEADROOM,    /* Priority headroom as an EWMA estimate */
+    RL_CONFIG_RETRANS,          /* Recognize retransmissions of dropped SYNs */
+    RL_CONFIG_REPUTATION,       /* Track handshake completions per source */
+    RL_CONFIG_REPUTATION_TTL,   /* How long(ns) a source that completed a
+                                 * handshake is considered known-good */
+    RL_CONFIG_HALFOPEN_MAX,     /* Outstanding handshakes allowed per source */
+    RL_CONFIG_HALFOPEN_TIMEOUT, /* Time(ns) after which the outstanding
+                                 * handshakes of a source are expired */
+    RL_CONFIG_MAX_CONCURRENT,   /* Established connections allowed per
+                                 * destination address and port */
+    RL_CONFIG_TRACK_HANDSHAKE,  /* Track admitted SYNs till the end of their
+                                 * handshake, set when any of the reputation,
+                                 * half-open or concurrency limits is on */
+    RL_CONFIG_RST_RATE,         /* RSTs per second sent by the rst action */
+    RL_CONFIG_MARK_DSCP,        /* DSCP set by the mark action */
+    RL_CONFIG_MARK_FLOW,        /* Mark the rest of the marked connections */
+    RL_CONFIG_PREMIUM_RATE,     /* Connections per second reserved for the
+                                 * premium DSCP class */
+    RL_CONFIG_REDIRECT_CPUS,    /* Number of CPUs of the redirect CPU set, the
+                                 * redirect device is used when zero */
+    RL_CONFIG_CLASSES,          /* Number of traffic class policies */
+    RL_CONFIG_FP,               /* Track SYN fingerprints */
+    RL_CONFIG_FP_RATE,          /* SYNs per second allowed per fingerprint */
+    RL_CONFIG_DECAP,            /* Look into IPIP, GRE, GUE and VXLAN */
+    RL_CONFIG_GUE_PORT,         /* UDP port of GUE, 0 to not decapsulate */
+    RL_CONFIG_VXLAN_PORT,       /* UDP port of VXLAN, 0 to not decapsulate */
+    RL_CONFIG_QUEUE_STATS,      /* Count the SYNs per RX queue and CPU */
+    RL_CONFIG_RAMP_EPOCH,       /* Start of the ramp in ns, 0 without ramp */
+    RL_CONFIG_RAMP_DURATION,    /* Length of the ramp in ns */
+    RL_CONFIG_RAMP_FLOOR,       /* Fraction of the limits at the start of
+                                 * the ramp, in 1/RL_RAMP_ONE */
+    RL_CONFIG_RAMP_SLOPE,       /* Fraction gained per RL_RAMP_TS_SHIFT time
+                                 * unit, in 1/RL_RAMP_ONE */
+    RL_CONFIG_HOT_KEYS,         /* Record the keys of the SYNs over the limit */
+    RL_CONFIG_WORKERS,          /* Workers sharing the rate in the reuseport
+                                 * program */
+    RL_CONFIG_XSK_FLAGS,        /* Flags of the xsk redirect, the action
+                                 * when no socket is bound to the queue */
+    RL_CONFIG_MAX
+};
+
+/* Limiter algorithms */
+enum rl_mode {
+    RL_MODE_WINDOW = 0,         /* Global sliding window(default) */
+    RL_MODE_GCRA,               /* Per-key generic cell rate algorithm */
+    RL_MODE_EWMA,               /* Per-key exponentially weighted rate */
+};
+
+/* Action taken on the connections over the limit, stored per port in
+ * rl_ports_map */
+enum rl_action {
+    RL_ACTION_DROP = 1,         /* Silently drop the SYN(default) */
+    RL_ACTION_RST,              /* Answer the SYN with a RST+ACK so the client
+                                 * fails fast, dropped above the RST rate */
+    RL_ACTION_MARK,             /* Pass the SYN with a scavenger DSCP so it is
+                                 * deprioritized downstream */
+    RL_ACTION_REDIRECT,         /* Redirect the SYN to the scrubbing device or
+                                 * CPU set for a heavier inspection */
+    RL_ACTION_XSK,              /* Redirect the SYN to the AF_XDP engine bound
+                                 * to its RX queue */
+};
+
+/* Protocols of the new connections, index of rl_proto_stats_map */
+enum rl_proto {
+    RL_PROTO_TCP = 0,           /* TCP SYNs */
+    RL_PROTO_QUIC,              /* QUIC Initial packets */
+    RL_PROTO_MAX
+};
+
+/* New connections received and over the limit per protocol, the latter
+ * include the ones the action passed marked, redirected or answered */
+struct rl_proto_stats {
+    __u64 recv;
+    __u64 drop;
+};
+
+/* QUIC versions whose long header packet types are known(RFC 9000 and
+ * RFC 9369), the other versions are assumed to follow version 1 */
+#define RL_QUIC_V2              0x6b3343cf
+#define RL_QUIC_TYPE_INITIAL_V1 0
+#define RL_QUIC_TYPE_INITIAL_V2 1
+
+/* Clients pad the datagrams carrying Initial packets to at least 1200
+ * bytes(RFC 9000 section 14.1), UDP header included here */
+#define RL_QUIC_MIN_INITIAL_LEN (1200 + 8)
+
+/* Maximum number of traffic class policies */
+#define RL_MAX_CLASSES          64
+
+/* Port of the packets matched by a traffic class policy */
+enum rl_match {
+    RL_MATCH_DST = 0,           /* Destination port, any port when 0 */
+    RL_MATCH_SRC,               /* Source port, for reflected traffic */
+};
+
+/* What a traffic class policy counts */
+enum rl_unit {
+    RL_UNIT_PKTS = 0,           /* Packets per second */
+    RL_UNIT_BYTES,              /* Bytes per second */
+};
+
+/* Matches the packets of a traffic class, ICMP and the other protocols
+ * without ports use port 0 */
+struct rl_class_key {
+    __u8 proto;
+    __u8 match;                 /* enum rl_match */
+    __u16 port;                 /* Host order */
+};
+
+/* Policy of a traffic class */
+struct rl_class_policy {
+    __u64 limit;                /* Packets or bytes per second and CPU */
+    __u32 unit;                 /* enum rl_unit */
+    __u32 id;                   /* Index of the class state and stats */
+};
+
+/* Two adjacent one second windows of the sliding window algorithm */
+struct rl_window {
+    __u64 start;                /* Start of the current window in ns */
+    __u64 curr;                 /* Count of the current window */
+    __u64 prev;                 /* Count of the previous window */
+};
+
+/* Traffic seen and dropped per traffic class */
+struct rl_class_stats {
+    __u64 pkts;
+    __u64 bytes;
+    __u64 drop_pkts;
+    __u64 drop_bytes;
+};
+
+/* Options of a SYN looked at for its fingerprint */
+#define RL_TCP_MAX_OPTIONS      10
+
+/* Size of the table of SYN fingerprints */
+#define RL_FP_ENTRIES           65536
+
+/* Number of fingerprints given their own rate */
+#define RL_FP_LIMIT_ENTRIES     1024
+
+/* SYN fingerprint, botnets rotate the source addresses but their SYNs
+ * share the same signature */
+struct rl_fp {
+    __u8 ttl;                   /* Initial TTL guess(32, 64, 128 or 255) */
+    __u8 wscale;                /* Window scale, 0xff without the option */
+    __u16 window;               /* Window size */
+    __u16 mss;                  /* MSS, 0 without the option */
+    __u16 nr_options;           /* Number of options */
+    __u8 options[RL_TCP_MAX_OPTIONS];   /* Option kinds in order */
+};
+
+/* Sliding window and counters of a SYN fingerprint */
+struct rl_fp_state {
+    struct rl_window window;
+    __u64 syns;
+    __u64 drops;
+};
+
+/* Ramp fractions are fixed point numbers with RL_RAMP_SHIFT fraction bits,
+ * the elapsed time is counted in units of 2^RL_RAMP_TS_SHIFT ns */
+#define RL_RAMP_SHIFT           32
+#define RL_RAMP_ONE             (1ULL << RL_RAMP_SHIFT)
+#define RL_RAMP_TS_SHIFT        20
+
+/* Size of the table of the keys over the limit */
+#define RL_HOT_ENTRIES          16384
+
+/* Key whose SYNs went over the limit, per CPU. The key is repeated in the
+ * value as older kernels reuse the per CPU slots of an evicted element
+ * without clearing them, the slots of another key are skipped. */
+struct rl_hot_key {
+    __u64 drops;
+    __u64 last_seen;
+    __u32 key;
+    __u32 pad;
+};
+
+/* RX queues the SYNs are counted for */
+#define RL_MAX_QUEUES           256
+
+/* SYNs seen on an RX queue by a CPU and the time spent deciding on them */
+struct rl_queue_stats {
+    __u64 syns;
+    __u64 drops;
+    __u64 ns;
+};
+
+/* Passive opens of a cgroup, kept in its cgroup storage. The limit is set
+ * by user space when the program is attached, 0 admits everything. */
+struct rl_cgroup_state {
+    struct rl_window window;
+    __u64 limit;                /* Connections per second */
+    __u64 syns;
+    __u64 drops;
+};
+
+/* Workers of the reuseport program and the workers looked at for a SYN,
+ * starting from the one of its hash */
+#define RL_MAX_WORKERS          64
+#define RL_REUSEPORT_PROBES     4
+
+/* SYNs taken within its share and beyond it by a worker of the reuseport
+ * program */
+struct rl_worker_state {
+    struct rl_window window;
+    __u64 syns;
+    __u64 overflows;
+};
+
+/* Maximum number of CPUs in the redirect CPU set */
+#define RL_REDIRECT_CPUS        64
+
+/* Admission classes of the inbound DSCP. The class is added to the window
+ * keys of rl_window_map(multiples of a second in ns), so every class has
+ * its own sliding window aged out by the same sweep. */
+enum rl_dscp_class {
+    RL_CLASS_DEFAULT = 0,
+    RL_CLASS_PREMIUM,
+    RL_CLASS_MAX
+};
+
+/* Size of rl_window_map, a minute of windows per class with room to spare
+ * as the windows are swept once a minute */
+#define RL_WINDOW_ENTRIES       (100 * RL_CLASS_MAX)
+
+/* Lower effort per-hop behavior(RFC 8622) */
+#define RL_DSCP_LE              1
+
+/* Size of the table of connections whose packets are marked */
+#define RL_MARK_FLOW_ENTRIES    262144
+
+/* The EWMA state is packed in a u64 per key, the upper 32 bits hold the
+ * smoothed rate as a fixed point number with RL_EWMA_FRAC_BITS fractional
+ * bits and the lower 32 bits the last update time in units of
+ * 2^RL_EWMA_TS_SHIFT ns(~1ms, wraps after ~52 days which the wrapping
+ * subtraction tolerates). */
+#define RL_EWMA_TS_SHIFT        20
+#define RL_EWMA_FRAC_BITS       8
+#define RL_EWMA_RATE_MAX        0xffffffffULL
+
+/* Size of the table of recently dropped SYNs */
+#define RL_RETRANS_ENTRIES      65536
+
+/* Clients back off at least a second before retransmitting a SYN, copies of
+ * a dropped SYN arriving sooner than this are not treated as retransmits */
+#define RL_RETRANS_MIN_GAP_NS   (RL_NANO / 2)
+
+/* Identifies a SYN by its 4-tuple and initial sequence number */
+struct rl_syn_key {
+    __u32 saddr;
+    __u32 daddr;
+    __u16 sport;
+    __u16 dport;
+    __u32 seq;
+};
+
+/* Size of the table of admitted SYNs waiting for the final ACK */
+#define RL_FLOW_ENTRIES         262144
+
+/* Size of the table of established connections */
+#define RL_CONN_ENTRIES         1048576
+
+/* Size of the table of established connection counts per service */
+#define RL_VIP_ENTRIES          4096
+
+/* Identifies a TCP connection by its 4-tuple */
+struct rl_flow_key {
+    __u32 saddr;
+    __u32 daddr;
+    __u16 sport;
+    __u16 dport;
+};
+
+/* Admitted SYN waiting for the final ACK of the handshake */
+struct rl_flow_state {
+    __u64 ts;                   /* Time the SYN was admitted */
+    __u32 isn;                  /* Initial sequence number(host order) */
+    __u32 srv_isn;              /* Initial sequence number of the server,
+                                 * from its SYN-ACK(host order) */
+    __u32 synack;               /* The SYN-ACK was seen */
+    __u32 pad;
+};
+
+/* Outstanding handshakes of a source */
+struct rl_halfopen {
+    __u64 count;                /* Admitted SYNs without a final ACK or RST */
+    __u64 ts;                   /* Time of the last admitted SYN */
+};
+
+/* Counter of the events of the current one second window */
+struct rl_bucket {
+    __u64 start;                /* Start of the window in ns */
+    __u64 count;                /* Events in the window */
+};
+
+/* Identifies a service by its destination address and port */
+struct rl_vip_key {
+    __u32 daddr;
+    __u16 dport;
+    __u16 pad;
+};
+
+/* Handshake statistics per ratelimited port, completed / admitted is the
+ * completion ratio which drops when spoofed SYNs get admitted */
+struct rl_port_stats {
+    __u64 syns;                 /* SYNs received */
+    __u64 admitted;             /* SYNs admitted */
+    __u64 completed;            /* Handshakes completed by the final ACK */
+};
+
+#endif
@@ -10,10 +10,14 @@
 #include <uapi/linux/ip.h>
 #include <uapi/linux/in.h>
 #include <uapi/linux/tcp.h>
+#include <uapi/linux/udp.h>
 
 #include "bpf_helpers.h"
 #include "bpf_endian.h"
 
+#include "ratelimiting_common.h"
+#include "ratelimiting_window.h"
+
 /* TCP flags */
 #define TCP_FIN  0x01
 #define TCP_SYN  0x02
@@ -25,21 +29,37 @@
 #define TCP_CWR  0x80
 #define TCP_FLAGS (TCP_FIN|TCP_SYN|TCP_RST|TCP_ACK|TCP_URG|TCP_ECE|TCP_CWR)
 
-/* Stores the ratelimit value(per second) */
+/* GRE flags */
+#define GRE_CSUM        0x8000
+#define GRE_KEY         0x2000
+#define GRE_SEQ         0x1000
+#define GRE_VERSION     0x0007
+
+/* VXLAN header length */
+#define VXLAN_HLEN      8
+
+#define TCPOPT_EOL      0
+#define TCPOPT_NOP      1
+#define TCPOPT_MSS      2
+#define TCPOPT_WINDOW   3
+
+/* Stores the ratelimit value(per second) and the limiter configuration,
+ * indexed by enum rl_config_idx */
 struct bpf_map_def SEC("maps") rl_config_map = {
 	.type		= BPF_MAP_TYPE_ARRAY,
 	.key_size	= sizeof(uint32_t),
 	.value_size	= sizeof(uint64_t),
-	.max_entries	= 1,
+	.max_entries	= RL_CONFIG_MAX,
 };
 
 /* Maintains the timestamp of a window and the total number of
- * connections received in that window(window = 1 sec interval) */
+ * connections received in that window(window = 1 sec interval), the
+ * DSCP class is added to the timestamp */
 struct bpf_map_def SEC("maps") rl_window_map = {
 	.type		= BPF_MAP_TYPE_HASH,
 	.key_size	= sizeof(uint64_t),
 	.value_size	= sizeof(uint64_t),
-	.max_entries	= 100,
+	.max_entries	= RL_WINDOW_ENTRIES,
 };
 
 /* Maintains the total number of connections received(TCP-SYNs)
@@ -76,64 +96,286 @@ struct bpf_map_def SEC("maps") xdp_rl_ingress_next_prog = {
         .max_entries    = 1
 };
 
+/* Maintains the theoretical arrival time(TAT) of the next connection per
+ * source key in GCRA mode. One u64 per key keeps the memory needed for
+ * large key tables predictable, size is set with --max-keys */
+struct bpf_map_def SEC("maps") rl_gcra_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_MAX_KEYS_DEFAULT,
+};
 
-/* TODO Use atomics or spin locks where naive increments are used depending
- * on the accuracy tests and then do a tradeoff.
- * With 10k connections/sec tests, the error rate is < 3%. */
-static __always_inline int _xdp_ratelimit(struct xdp_md *ctx)
-{
-    void *data_end = (void *)(long)ctx->data_end;
-    void *data = (void *)(long)ctx->data;
+/* Maintains the packed {rate, last_ts} EWMA state per source key, used by
+ * the EWMA mode and as a per-source score by the other modes */
+struct bpf_map_def SEC("maps") rl_ewma_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_MAX_KEYS_DEFAULT,
+};
 
-    struct ethhdr *eth = data;
+/* Maintains the SYNs dropped recently along with the time they were dropped
+ * so their retransmissions can be recognized */
+struct bpf_map_def SEC("maps") rl_retrans_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(struct rl_syn_key),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_RETRANS_ENTRIES,
+};
 
-    /* Check if it is a valid ethernet packet */
-    if (data + sizeof(*eth) > data_end)
-        return XDP_DROP;
+/* Maintains the total number of retransmitted SYNs received, these are not
+ * counted in rl_recv_count_map. Used only for metrics visibility */
+struct bpf_map_def SEC("maps") rl_retrans_count_map = {
+	.type		= BPF_MAP_TYPE_HASH,
+	.key_size	= sizeof(uint64_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= 1
+};
 
-    /* Ignore other than ethernet packets */
-    uint16_t eth_type = eth->h_proto;
-    if (ntohs(eth_type) != ETH_P_IP) {
-        return XDP_PASS;
-    }
+/* Maintains the admitted SYNs waiting for the final ACK of the handshake */
+struct bpf_map_def SEC("maps") rl_syn_flow_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(struct rl_flow_key),
+	.value_size	= sizeof(struct rl_flow_state),
+	.max_entries	= RL_FLOW_ENTRIES,
+};
 
-    /* Ignore other than IP packets */
-    struct iphdr *iph = data + sizeof(struct ethhdr);
-    if (iph + 1 > data_end)
-        return XDP_PASS;
+/* Maintains the time at which a source last completed a handshake, spoofed
+ * sources never complete one */
+struct bpf_map_def SEC("maps") rl_reputation_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_MAX_KEYS_DEFAULT,
+};
 
-    /* Ignore other than TCP packets */
-    if (iph->protocol != IPPROTO_TCP)
-        return XDP_PASS;
+/* Maintains the handshake statistics per ratelimited port, the entries are
+ * initialised in the user space. Used only for metrics visibility */
+struct bpf_map_def SEC("maps") rl_port_stats_map = {
+        .type           = BPF_MAP_TYPE_HASH,
+        .key_size       = sizeof(uint16_t),
+        .value_size     = sizeof(struct rl_port_stats),
+        .max_entries    = 50
+};
 
-    /* Check if its valid tcp packet */
-    struct tcphdr *tcph = (struct tcphdr *)(iph + 1);
-    if (tcph + 1 > data_end)
-        return XDP_PASS;
+/* Maintains the number of outstanding handshakes per source, all of them
+ * expire once the source has not been admitted a SYN for the timeout */
+struct bpf_map_def SEC("maps") rl_halfopen_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(struct rl_halfopen),
+	.max_entries	= RL_MAX_KEYS_DEFAULT,
+};
 
-    /* Ignore other than TCP-SYN packets */
-    if (!(tcph->syn & TCP_FLAGS))
-        return XDP_PASS;
+/* Maintains the established connections to the ratelimited ports and the
+ * time they were last seen. The connections whose FIN or RST was missed are
+ * expired by the user space program, which then recounts rl_vip_conn_map */
+struct bpf_map_def SEC("maps") rl_conn_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(struct rl_flow_key),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_CONN_ENTRIES,
+};
 
-    /* Ignore TCP-SYN-ACK packets */
-    if (tcph->ack & TCP_FLAGS)
-        return XDP_PASS;
+/* Maintains the number of established connections per destination address
+ * and port */
+struct bpf_map_def SEC("maps") rl_vip_conn_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(struct rl_vip_key),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_VIP_ENTRIES,
+};
 
-    uint16_t dstport = bpf_ntohs(tcph->dest);
-    if(!bpf_map_lookup_elem(&rl_ports_map, &dstport))
-        return XDP_PASS;
+/* Maintains the RSTs sent in the current second by the rst action */
+struct bpf_map_def SEC("maps") rl_rst_bucket_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(struct rl_bucket),
+	.max_entries	= 1,
+};
 
-    uint64_t rkey = 0;
-    uint64_t *rate = bpf_map_lookup_elem(&rl_config_map, &rkey);
+/* Maintains the total number of SYNs answered with a RST
+ * Used only for metrics visibility */
+struct bpf_map_def SEC("maps") rl_rst_count_map = {
+	.type		= BPF_MAP_TYPE_HASH,
+	.key_size	= sizeof(uint64_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= 1
+};
 
-    if (!rate)
-        return XDP_PASS;
+/* Maintains the connections whose SYN was marked, so the rest of their
+ * packets are marked too */
+struct bpf_map_def SEC("maps") rl_mark_flow_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(struct rl_flow_key),
+	.value_size	= sizeof(uint8_t),
+	.max_entries	= RL_MARK_FLOW_ENTRIES,
+};
 
-    /* Current time in monotonic clock */
-    uint64_t tnow = bpf_ktime_get_ns();
+/* Maintains the total number of SYNs over the limit passed with the
+ * scavenger DSCP. Used only for metrics visibility */
+struct bpf_map_def SEC("maps") rl_mark_count_map = {
+	.type		= BPF_MAP_TYPE_HASH,
+	.key_size	= sizeof(uint64_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= 1
+};
+
+/* Maintains the admission class of every DSCP value */
+struct bpf_map_def SEC("maps") rl_dscp_class_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint8_t),
+	.max_entries	= 64,
+};
+
+/* Maintains the scrubbing device the redirect action sends the SYNs to */
+struct bpf_map_def SEC("maps") rl_redirect_dev_map = {
+	.type		= BPF_MAP_TYPE_DEVMAP,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint32_t),
+	.max_entries	= 1,
+};
+
+/* Maintains the CPUs dedicated to the inspection, keyed by CPU id */
+struct bpf_map_def SEC("maps") rl_redirect_cpu_map = {
+	.type		= BPF_MAP_TYPE_CPUMAP,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint32_t),
+	.max_entries	= RL_REDIRECT_CPUS,
+};
+
+/* Maintains the CPU ids of the redirect CPU set */
+struct bpf_map_def SEC("maps") rl_redirect_cpus_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint32_t),
+	.max_entries	= RL_REDIRECT_CPUS,
+};
+
+/* Maintains the number of SYNs redirected per target, the slot of the CPU
+ * in the CPU set or 0 for the device. Used only for metrics visibility */
+struct bpf_map_def SEC("maps") rl_redirect_count_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_REDIRECT_CPUS,
+};
+
+/* Maintains the UDP ports whose QUIC connections are ratelimited and the
+ * action taken on the connections over the limit */
+struct bpf_map_def SEC("maps") rl_quic_ports_map = {
+        .type           = BPF_MAP_TYPE_HASH,
+        .key_size       = sizeof(uint16_t),
+        .value_size     = sizeof(uint8_t),
+        .max_entries    = 50
+};
+
+/* Maintains the new connections received and dropped per protocol
+ * Used only for metrics visibility */
+struct bpf_map_def SEC("maps") rl_proto_stats_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(struct rl_proto_stats),
+	.max_entries	= RL_PROTO_MAX,
+};
+
+/* Maintains the traffic class policies, any IPv4 packet matching one is
+ * counted in packets or bytes against its limit */
+struct bpf_map_def SEC("maps") rl_class_policy_map = {
+	.type		= BPF_MAP_TYPE_HASH,
+	.key_size	= sizeof(struct rl_class_key),
+	.value_size	= sizeof(struct rl_class_policy),
+	.max_entries	= RL_MAX_CLASSES,
+};
+
+/* Maintains the sliding window of every traffic class, per CPU so the
+ * classes carrying a flood are not contended on every packet */
+struct bpf_map_def SEC("maps") rl_class_window_map = {
+	.type		= BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(struct rl_window),
+	.max_entries	= RL_MAX_CLASSES,
+};
+
+/* Maintains the traffic seen and dropped per traffic class, per CPU
+ * Used only for metrics visibility */
+struct bpf_map_def SEC("maps") rl_class_stats_map = {
+	.type		= BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(struct rl_class_stats),
+	.max_entries	= RL_MAX_CLASSES,
+};
 
+/* Maintains the sliding window and the counters per SYN fingerprint */
+struct bpf_map_def SEC("maps") rl_fp_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(struct rl_fp),
+	.value_size	= sizeof(struct rl_fp_state),
+	.max_entries	= RL_FP_ENTRIES,
+};
+
+/* Rate per second of the fingerprints throttled on their own, overriding
+ * RL_CONFIG_FP_RATE */
+struct bpf_map_def SEC("maps") rl_fp_limit_map = {
+	.type		= BPF_MAP_TYPE_HASH,
+	.key_size	= sizeof(struct rl_fp),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_FP_LIMIT_ENTRIES,
+};
+
+/* Maintains the SYNs received and dropped per RX queue, per CPU
+ * Used only to detect RSS imbalance */
+struct bpf_map_def SEC("maps") rl_queue_stats_map = {
+	.type		= BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(struct rl_queue_stats),
+	.max_entries	= RL_MAX_QUEUES,
+};
+
+/* Maintains the keys whose SYNs went over the limit, a small table that is
+ * read for the top-N and forensic dumps instead of the per key state.
+ * Per CPU as a flooding key is dropped on every CPU at once. */
+struct bpf_map_def SEC("maps") rl_hot_map = {
+	.type		= BPF_MAP_TYPE_LRU_PERCPU_HASH,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(struct rl_hot_key),
+	.max_entries	= RL_HOT_ENTRIES,
+};
+
+/* AF_XDP sockets of the engine, keyed by the RX queue they are bound to */
+struct bpf_map_def SEC("maps") rl_xsk_map = {
+	.type		= BPF_MAP_TYPE_XSKMAP,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint32_t),
+	.max_entries	= RL_MAX_QUEUES,
+};
+
+/* Maintains the total number of SYNs over the limit handed to the AF_XDP
+ * engine. Used only for metrics visibility */
+struct bpf_map_def SEC("maps") rl_xsk_count_map = {
+	.type		= BPF_MAP_TYPE_HASH,
+	.key_size	= sizeof(uint64_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= 1
+};
+
+/* Returns the configuration value stored at idx in rl_config_map */
+static __always_inline uint64_t rl_config(uint32_t idx)
+{
+    uint64_t *val = bpf_map_lookup_elem(&rl_config_map, &idx);
+
+    return val ? *val : 0;
+}
+
+/* Sliding window decision over the global window map for the connections
+ * of the given DSCP class */
+static __always_inline int rl_sliding_window(uint64_t rate, uint64_t tnow,
+                                             uint64_t dscp_class)
+{
     /* Used for second to nanoseconds conversions and vice-versa */
-    uint64_t NANO = 1000000000;
+    uint64_t NANO = RL_NANO;
 
     /* Used for converting decimals points to percentages as decimal points
      * are not recommended in the kernel.
@@ -145,7 +387,8 @@ static __always_inline int _xdp_ratelimit(struct xdp_md *ctx)
      * Ex: ts of the incoming connections from the time 16625000000000 till
      * 166259999999 is rounded off to 166250000000000 to track the incoming
      * connections received in that one second interval. */
-    uint64_t cw_key = tnow / NANO * NANO;
+    uint64_t cw_start = tnow / NANO * NANO;
+    uint64_t cw_key = cw_start + dscp_class;
 
     /* Previous window is one second before the current window */
     uint64_t pw_key = cw_key - NANO;
@@ -156,21 +399,6 @@ static __always_inline int _xdp_ratelimit(struct xdp_md *ctx)
     /* Number of incoming connections in the current window(second) */
     uint32_t *cw_count = bpf_map_lookup_elem(&rl_window_map, &cw_key);
 
-    /* Total number of incoming connections so far */
-    uint64_t *in_count = bpf_map_lookup_elem(&rl_recv_count_map, &rkey);
-
-    /* Total number of dropped connections so far */
-    uint64_t *drop_count = bpf_map_lookup_elem(&rl_drop_count_map, &rkey);
-
-    /* Just make the verifier happy, it would never be the case in real as
-     * these two counters are initialised in the user space. */
-    if(!in_count || !drop_count)
-        return XDP_PASS;
-
-    /* Increment the total number of incoming connections counter */
-
-    (*in_count)++;
-
     if (!cw_count)
     {
         /* This is the first connection in the current window,
@@ -187,11 +415,10 @@ static __always_inline int _xdp_ratelimit(struct xdp_md *ctx)
         /* This is the fresh start of system or there have been no
          * connections in the last second, so make the decision purely based
          * on the incoming connections in the current window. */
-        if (*cw_count >= *rate)
+        if (*cw_count >= rate)
         {
             /* Connection count in the current window already exceeded the
              * rate limit so drop this connection. */
-            (*drop_count)++;
             return XDP_DROP;
         }
         /* Allow otherwise */
@@ -204,16 +431,15 @@ static __always_inline int _xdp_ratelimit(struct xdp_md *ctx)
      * current window based on what % of the sliding window(tnow - 1) falls *
      * in previous window and what % of it is in the current window         */
     uint64_t pw_weight = MULTIPLIER -
-        (uint64_t)(((tnow - cw_key) * MULTIPLIER) / NANO);
+        (uint64_t)(((tnow - cw_start) * MULTIPLIER) / NANO);
 
     uint64_t total_count = (uint64_t)((pw_weight * (*pw_count)) +
         (*cw_count) * MULTIPLIER);
 
-    if (total_count > ((*rate) * MULTIPLIER))
+    if (total_count > (rate * MULTIPLIER))
     {
         /* Connection count from tnow to (tnow-1) exceeded the rate limit,
          * so drop this connection. */
-        (*drop_count)++;
         return XDP_DROP;
     }
     /* Allow otherwise */
@@ -221,13 +447,1115 @@ static __always_inline int _xdp_ratelimit(struct xdp_md *ctx)
     return XDP_PASS;
 }
 
+/* GCRA decision for a single key, see rl_gcra_admit. headroom extends the
+ * burst tolerance by that many connections. */
+static __always_inline int rl_gcra(uint32_t key, uint64_t tnow,
+                                   uint64_t headroom, uint64_t ramp)
+{
+    uint64_t interval = rl_config(RL_CONFIG_GCRA_INTERVAL);
+    uint64_t tolerance = rl_config(RL_CONFIG_GCRA_TOLERANCE);
+
+    /* A lower rate is a longer emission interval, the division only
+     * happens during the ramp */
+    if (ramp && ramp < RL_RAMP_ONE)
+        interval = (interval << RL_RAMP_SHIFT) / ramp;
+    tolerance += headroom * interval;
+    uint64_t *tat = bpf_map_lookup_elem(&rl_gcra_map, &key);
+
+    if (!tat)
+    {
+        /* First connection from this key */
+        uint64_t next_tat = tnow + interval;
+        bpf_map_update_elem(&rl_gcra_map, &key, &next_tat, BPF_ANY);
+        return XDP_PASS;
+    }
+    return rl_gcra_admit(tat, tnow, interval, tolerance);
+}
+
+/* Decays the EWMA estimate of key to tnow and returns it. The connection is
+ * charged to the key only when the decayed estimate is below limit, pass
+ * ~0 to always charge it.
+ * The estimate halves every 2^shift time units. Whole half-lives are
+ * applied with a shift and the remainder by interpolating linearly
+ * between the estimate and its half, so no division is needed on the fast
+ * path and the estimate of an idle key only decreases. */
+static __always_inline uint64_t rl_ewma(uint32_t key, uint64_t tnow,
+                                        uint64_t limit)
+{
+    uint32_t shift = (uint32_t)rl_config(RL_CONFIG_EWMA_SHIFT) & 31;
+    uint32_t now = (uint32_t)(tnow >> RL_EWMA_TS_SHIFT);
+    uint64_t *state = bpf_map_lookup_elem(&rl_ewma_map, &key);
+    uint64_t rate = 0, next_rate;
+
+    if (state)
+    {
+        uint32_t elapsed = now - (uint32_t)*state;
+        uint32_t halves = elapsed >> shift;
+
+        rate = *state >> 32;
+        if (halves >= 32) {
+            rate = 0;
+        } else {
+            /* 2^-x ~= 1 - x / 2 for the fraction x of a half-life, exact
+             * at both of its ends */
+            uint64_t decay;
+
+            rate >>= halves;
+            decay = (rate * (elapsed & ((1U << shift) - 1))) >> shift;
+            rate -= decay >> 1;
+        }
+    }
+
+    next_rate = rate;
+    if (rate < limit)
+    {
+        next_rate += 1 << RL_EWMA_FRAC_BITS;
+        if (next_rate > RL_EWMA_RATE_MAX)
+            next_rate = RL_EWMA_RATE_MAX;
+    }
+
+    next_rate = (next_rate << 32) | now;
+    if (state)
+        *state = next_rate;
+    else
+        bpf_map_update_elem(&rl_ewma_map, &key, &next_rate, BPF_ANY);
+
+    return rate;
+}
+
+/* Returns true when the connection is admitted in the budget reserved for
+ * its DSCP class, it does not consume the shared budget then */
+static __always_inline int rl_dscp_reserved(struct iphdr *iph, uint64_t tnow)
+{
+    uint32_t dscp = iph->tos >> 2;
+    uint8_t *dscp_class = bpf_map_lookup_elem(&rl_dscp_class_map, &dscp);
+
+    if (!dscp_class || *dscp_class != RL_CLASS_PREMIUM)
+        return 0;
+
+    return rl_sliding_window(rl_config(RL_CONFIG_PREMIUM_RATE), tnow,
+                             RL_CLASS_PREMIUM) == XDP_PASS;
+}
+
+/* Fraction of the limits, in 1/RL_RAMP_ONE, reached by the ramp started at
+ * the stored epoch. The limits grow linearly from the floor to the full
+ * rate, from the epoch alone so user space has nothing to update. */
+static __always_inline uint64_t rl_ramp(uint64_t tnow)
+{
+    uint64_t epoch = rl_config(RL_CONFIG_RAMP_EPOCH);
+    uint64_t fraction;
+
+    if (!epoch || tnow < epoch ||
+        tnow - epoch >= rl_config(RL_CONFIG_RAMP_DURATION))
+        return RL_RAMP_ONE;
+
+    fraction = rl_config(RL_CONFIG_RAMP_FLOOR) +
+        ((tnow - epoch) >> RL_RAMP_TS_SHIFT) * rl_config(RL_CONFIG_RAMP_SLOPE);
+    return fraction < RL_RAMP_ONE ? fraction : RL_RAMP_ONE;
+}
+
+/* Runs the configured limiter for a connection of key. Priority connections
+ * are checked against the budget extended by the configured headroom, so
+ * they are admitted ahead of the others while the limit is saturated. */
+static __always_inline int rl_decide(uint32_t key, uint64_t tnow,
+                                     uint64_t rate, int priority)
+{
+    uint64_t mode = rl_config(RL_CONFIG_MODE);
+    uint64_t ewma_limit = rl_config(RL_CONFIG_EWMA_LIMIT);
+    uint64_t ramp = rl_ramp(tnow);
+    uint64_t headroom = 0;
+
+    /* The ramp scales the limits, not the priority headroom */
+    if (ramp < RL_RAMP_ONE)
+    {
+        rate = (rate * ramp) >> RL_RAMP_SHIFT;
+        ewma_limit = (ewma_limit * ramp) >> RL_RAMP_SHIFT;
+    }
+
+    if (priority)
+    {
+        headroom = rl_config(RL_CONFIG_PRIORITY_HEADROOM);
+        ewma_limit += rl_config(RL_CONFIG_EWMA_HEADROOM);
+    }
+
+    if (mode == RL_MODE_EWMA)
+        return rl_ewma(key, tnow, ewma_limit) >= ewma_limit ?
+            XDP_DROP : XDP_PASS;
+
+    /* Source is already sending above its smoothed rate, do not let it
+     * consume the budget of the others */
+    if (rl_config(RL_CONFIG_EWMA_SCORE) &&
+        rl_ewma(key, tnow, ~0ULL) >= ewma_limit)
+        return XDP_DROP;
+
+    if (mode == RL_MODE_GCRA)
+        return rl_gcra(key, tnow, headroom, ramp);
+    return rl_sliding_window(rate + headroom, tnow, RL_CLASS_DEFAULT);
+}
+
+/* Looks at the ACKs and RSTs sent to the ratelimited ports. The ACK
+ * completing the handshake of an admitted SYN marks its source as
+ * known-good and the connection as established, both end the handshake for
+ * the half-open accounting. The client picks its own ISN, so the ACK only
+ * completes the handshake when it acknowledges the ISN of the server, which
+ * the SYN-ACK program records at the egress. Without it no handshake
+ * completes and the outstanding ones time out. Returns true when the packet
+ * ended a handshake. */
+static __always_inline int rl_handshake_end(struct iphdr *iph,
+                                            struct tcphdr *tcph,
+                                            uint64_t max_concurrent)
+{
+    uint64_t track_reputation = rl_config(RL_CONFIG_REPUTATION);
+    uint64_t halfopen_max = rl_config(RL_CONFIG_HALFOPEN_MAX);
+
+    /* Entries exist only for the ratelimited ports */
+    uint16_t dstport = bpf_ntohs(tcph->dest);
+    struct rl_port_stats *stats = bpf_map_lookup_elem(&rl_port_stats_map,
+                                                      &dstport);
+    if (!stats)
+        return 0;
+
+    struct rl_flow_key fkey = {
+        .saddr = iph->saddr,
+        .daddr = iph->daddr,
+        .sport = tcph->source,
+        .dport = tcph->dest,
+    };
+    struct rl_flow_state *flow = bpf_map_lookup_elem(&rl_syn_flow_map, &fkey);
+    if (!flow)
+        return 0;
+    if (bpf_ntohl(tcph->seq) != flow->isn + 1)
+        return 0;
+    if (!tcph->rst &&
+        (!flow->synack || bpf_ntohl(tcph->ack_seq) != flow->srv_isn + 1))
+        return 0;
+
+    bpf_map_delete_elem(&rl_syn_flow_map, &fkey);
+
+    uint32_t saddr = iph->saddr;
+    if (halfopen_max)
+    {
+        struct rl_halfopen *ho = bpf_map_lookup_elem(&rl_halfopen_map, &saddr);
+        if (ho && ho->count)
+            __sync_fetch_and_add(&ho->count, -1);
+    }
+
+    if (tcph->rst)
+        return 1;
+
+    uint64_t tnow = bpf_ktime_get_ns();
+    if (track_reputation)
+        bpf_map_update_elem(&rl_reputation_map, &saddr, &tnow, BPF_ANY);
+
+    if (max_concurrent)
+    {
+        struct rl_vip_key vkey = {
+            .daddr = iph->daddr,
+            .dport = tcph->dest,
+        };
+        uint64_t *conns = bpf_map_lookup_elem(&rl_vip_conn_map, &vkey);
+
+        if (bpf_map_update_elem(&rl_conn_map, &fkey, &tnow,
+                                BPF_NOEXIST) == 0)
+        {
+            if (conns) {
+                __sync_fetch_and_add(conns, 1);
+            } else {
+                uint64_t init_conns = 1;
+                bpf_map_update_elem(&rl_vip_conn_map, &vkey, &init_conns,
+                                    BPF_ANY);
+            }
+        }
+    }
+    __sync_fetch_and_add(&stats->completed, 1);
+    return 1;
+}
+
+/* Refreshes the established connection of the packet, a FIN or a RST
+ * ends it */
+static __always_inline void rl_conn_update(struct iphdr *iph,
+                                           struct tcphdr *tcph)
+{
+    struct rl_flow_key fkey = {
+        .saddr = iph->saddr,
+        .daddr = iph->daddr,
+        .sport = tcph->source,
+        .dport = tcph->dest,
+    };
+    uint64_t *seen = bpf_map_lookup_elem(&rl_conn_map, &fkey);
+    if (!seen)
+        return;
+
+    uint64_t tnow = bpf_ktime_get_ns();
+    if (!tcph->fin && !tcph->rst)
+    {
+        /* Refresh at most once a second to limit the writes */
+        if (tnow - *seen > RL_NANO)
+            *seen = tnow;
+        return;
+    }
+
+    if (bpf_map_delete_elem(&rl_conn_map, &fkey))
+        return;
+
+    struct rl_vip_key vkey = {
+        .daddr = iph->daddr,
+        .dport = tcph->dest,
+    };
+    uint64_t *conns = bpf_map_lookup_elem(&rl_vip_conn_map, &vkey);
+    if (conns && *conns)
+        __sync_fetch_and_add(conns, -1);
+}
+
+/* Looks at the packets other than SYNs sent to the ratelimited ports */
+static __always_inline void rl_track_flow(struct iphdr *iph,
+                                          struct tcphdr *tcph)
+{
+    if (!rl_config(RL_CONFIG_TRACK_HANDSHAKE))
+        return;
+
+    uint64_t max_concurrent = rl_config(RL_CONFIG_MAX_CONCURRENT);
+    if ((tcph->ack || tcph->rst) && !tcph->fin &&
+        rl_handshake_end(iph, tcph, max_concurrent))
+        return;
+
+    if (max_concurrent)
+        rl_conn_update(iph, tcph);
+}
+
+/* Returns true when the destination of the SYN already has the maximum
+ * number of established connections */
+static __always_inline int rl_concurrency_full(struct iphdr *iph,
+                                               struct tcphdr *tcph,
+                                               uint64_t max_concurrent)
+{
+    struct rl_vip_key vkey = {
+        .daddr = iph->daddr,
+        .dport = tcph->dest,
+    };
+    uint64_t *conns = bpf_map_lookup_elem(&rl_vip_conn_map, &vkey);
+
+    return conns && *conns >= max_concurrent;
+}
+
+/* Returns true when the source already has the maximum number of
+ * outstanding handshakes, ignoring the ones that timed out */
+static __always_inline int rl_halfopen_full(uint32_t saddr, uint64_t tnow,
+                                            uint64_t halfopen_max)
+{
+    struct rl_halfopen *ho = bpf_map_lookup_elem(&rl_halfopen_map, &saddr);
+
+    return ho && ho->count >= halfopen_max &&
+        tnow - ho->ts < rl_config(RL_CONFIG_HALFOPEN_TIMEOUT);
+}
+
+/* Accounts an admitted SYN as an outstanding handshake of the source */
+static __always_inline void rl_halfopen_add(uint32_t saddr, uint64_t tnow)
+{
+    struct rl_halfopen *ho = bpf_map_lookup_elem(&rl_halfopen_map, &saddr);
+
+    if (!ho || tnow - ho->ts >= rl_config(RL_CONFIG_HALFOPEN_TIMEOUT))
+    {
+        /* First outstanding handshake or the earlier ones have expired */
+        struct rl_halfopen init = {
+            .count = 1,
+            .ts = tnow,
+        };
+        bpf_map_update_elem(&rl_halfopen_map, &saddr, &init, BPF_ANY);
+        return;
+    }
+    __sync_fetch_and_add(&ho->count, 1);
+    ho->ts = tnow;
+}
+
+/* Folds a 32 bit checksum into the 16 bit ones' complement checksum */
+static __always_inline uint16_t rl_csum_fold(uint32_t csum)
+{
+    csum = (csum & 0xffff) + (csum >> 16);
+    csum = (csum & 0xffff) + (csum >> 16);
+    return (uint16_t)~csum;
+}
+
+/* Rewrites the DSCP of the packet keeping its ECN bits, the IP checksum is
+ * updated incrementally(RFC 1624) over the 16 bit word holding the TOS */
+static __always_inline void rl_set_dscp(struct iphdr *iph, uint8_t dscp)
+{
+    uint8_t tos = (dscp << 2) | (iph->tos & 0x3);
+    uint16_t old_word, new_word;
+
+    if (tos == iph->tos)
+        return;
+
+    old_word = *(uint16_t *)iph;
+    iph->tos = tos;
+    new_word = *(uint16_t *)iph;
+    iph->check = rl_csum_fold((uint16_t)~iph->check + (uint16_t)~old_word +
+                              new_word);
+}
+
+/* Marks the packets of the connections whose SYN was marked */
+static __always_inline void rl_mark_flow(struct iphdr *iph,
+                                         struct tcphdr *tcph)
+{
+    struct rl_flow_key fkey = {
+        .saddr = iph->saddr,
+        .daddr = iph->daddr,
+        .sport = tcph->source,
+        .dport = tcph->dest,
+    };
+    uint8_t *dscp = bpf_map_lookup_elem(&rl_mark_flow_map, &fkey);
+
+    if (!dscp)
+        return;
+
+    rl_set_dscp(iph, *dscp);
+    if (tcph->fin || tcph->rst)
+        bpf_map_delete_elem(&rl_mark_flow_map, &fkey);
+}
+
+/* Returns true while the RSTs sent in the current second are within the
+ * configured RST rate */
+static __always_inline int rl_rst_budget(uint64_t tnow)
+{
+    uint32_t idx = 0;
+    struct rl_bucket *bucket = bpf_map_lookup_elem(&rl_rst_bucket_map, &idx);
+    uint64_t start = tnow / RL_NANO * RL_NANO;
+
+    if (!bucket)
+        return 0;
+    if (bucket->start != start)
+    {
+        bucket->start = start;
+        bucket->count = 0;
+    }
+    if (bucket->count >= rl_config(RL_CONFIG_RST_RATE))
+        return 0;
+
+    __sync_fetch_and_add(&bucket->count, 1);
+    return 1;
+}
+
+/* Rewrites the SYN in place into a RST+ACK back to the client, so it fails
+ * fast instead of retransmitting the SYN. Options and payload are trimmed.
+ * Falls back to a drop when the RST rate is exceeded. */
+static __always_inline int rl_reject_rst(struct xdp_md *ctx,
+                                         struct ethhdr *eth,
+                                         struct iphdr *iph,
+                                         struct tcphdr *tcph,
+                                         uint64_t tnow)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    unsigned char mac[ETH_ALEN];
+    uint32_t addr;
+    uint16_t port;
+
+    /* IP options are not stripped */
+    if (iph->ihl != 5 || !rl_rst_budget(tnow))
+        return XDP_DROP;
+
+    __builtin_memcpy(mac, eth->h_source, ETH_ALEN);
+    __builtin_memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
+    __builtin_memcpy(eth->h_dest, mac, ETH_ALEN);
+
+    addr = iph->saddr;
+    iph->saddr = iph->daddr;
+    iph->daddr = addr;
+    iph->tot_len = bpf_htons(sizeof(struct iphdr) + sizeof(struct tcphdr));
+    iph->id = 0;
+    iph->frag_off = bpf_htons(0x4000);
+    iph->ttl = 64;
+    iph->check = 0;
+    iph->check = rl_csum_fold(bpf_csum_diff(0, 0, (void *)iph,
+                                            sizeof(struct iphdr), 0));
+
+    port = tcph->source;
+    tcph->source = tcph->dest;
+    tcph->dest = port;
+    /* The SYN consumes one sequence number */
+    tcph->ack_seq = bpf_htonl(bpf_ntohl(tcph->seq) + 1);
+    tcph->seq = 0;
+    /* Data offset of a header without options, RST and ACK flags */
+    ((uint8_t *)tcph)[12] = (sizeof(struct tcphdr) / 4) << 4;
+    ((uint8_t *)tcph)[13] = TCP_RST | TCP_ACK;
+    tcph->window = 0;
+    tcph->urg_ptr = 0;
+    tcph->check = 0;
+
+    struct {
+        uint32_t saddr;
+        uint32_t daddr;
+        uint8_t zero;
+        uint8_t protocol;
+        uint16_t len;
+    } pseudo = {
+        .saddr = iph->saddr,
+        .daddr = iph->daddr,
+        .protocol = IPPROTO_TCP,
+        .len = bpf_htons(sizeof(struct tcphdr)),
+    };
+    uint32_t csum = bpf_csum_diff(0, 0, (void *)&pseudo, sizeof(pseudo), 0);
+    csum = bpf_csum_diff(0, 0, (void *)tcph, sizeof(struct tcphdr), csum);
+    tcph->check = rl_csum_fold(csum);
+
+    int delta = (int)(sizeof(struct ethhdr) + sizeof(struct iphdr) +
+                      sizeof(struct tcphdr)) - (int)(data_end - data);
+    if (delta < 0 && bpf_xdp_adjust_tail(ctx, delta))
+        return XDP_DROP;
+
+    uint64_t rkey = 0;
+    uint64_t *rst_count = bpf_map_lookup_elem(&rl_rst_count_map, &rkey);
+    if (rst_count)
+        (*rst_count)++;
+    return XDP_TX;
+}
+
+/* Redirects the SYN to the scrubbing device, or to the CPU set spreading
+ * the sources over it, so floods are inspected away from the cores serving
+ * the admitted traffic */
+static __always_inline int rl_redirect(struct iphdr *iph)
+{
+    uint64_t nr_cpus = rl_config(RL_CONFIG_REDIRECT_CPUS);
+    uint32_t slot = 0;
+    int rc;
+
+    if (nr_cpus)
+    {
+        slot = bpf_ntohl(iph->saddr) % nr_cpus;
+        uint32_t *cpu = bpf_map_lookup_elem(&rl_redirect_cpus_map, &slot);
+        if (!cpu)
+            return XDP_DROP;
+        rc = bpf_redirect_map(&rl_redirect_cpu_map, *cpu, 0);
+    }
+    else
+    {
+        rc = bpf_redirect_map(&rl_redirect_dev_map, 0, 0);
+    }
+    if (rc != XDP_REDIRECT)
+        return XDP_DROP;
+
+    uint64_t *redirect_count = bpf_map_lookup_elem(&rl_redirect_count_map,
+                                                   &slot);
+    if (redirect_count)
+        __sync_fetch_and_add(redirect_count, 1);
+    return XDP_REDIRECT;
+}
+
+struct gre_base_hdr {
+    uint16_t flags;
+    uint16_t protocol;
+};
+
+/* Accounts a SYN and the time spent deciding on it to the RX queue it
+ * arrived on, the map is per CPU so no atomics are needed */
+static __always_inline void rl_queue_count(struct xdp_md *ctx, int rc,
+                                           uint64_t tnow)
+{
+    uint32_t queue = ctx->rx_queue_index;
+    struct rl_queue_stats *stats;
+
+    stats = bpf_map_lookup_elem(&rl_queue_stats_map, &queue);
+    if (!stats)
+        return;
+
+    stats->syns++;
+    if (rc == XDP_DROP)
+        stats->drops++;
+    stats->ns += bpf_ktime_get_ns() - tnow;
+}
+
+/* Records a SYN of key over the limit, in the slot of this CPU */
+static __always_inline void rl_hot_add(uint32_t key, uint64_t tnow)
+{
+    struct rl_hot_key *hot = bpf_map_lookup_elem(&rl_hot_map, &key);
+
+    if (!hot)
+    {
+        struct rl_hot_key init = {
+            .drops = 1,
+            .last_seen = tnow,
+            .key = key,
+        };
+        bpf_map_update_elem(&rl_hot_map, &key, &init, BPF_NOEXIST);
+        return;
+    }
+    if (hot->key != key)
+    {
+        hot->key = key;
+        hot->drops = 0;
+    }
+    hot->drops++;
+    hot->last_seen = tnow;
+}
+
+/* Returns the inner IPv4 header of the IPIP, GRE, GUE and VXLAN packets and
+ * the outer one of the others. Only one level of encapsulation is looked
+ * into and the packet itself is left untouched. */
+static __always_inline struct iphdr *rl_decap(struct iphdr *iph,
+                                              void *data_end)
+{
+    void *inner = NULL;
+
+    if (iph->protocol == IPPROTO_IPIP)
+    {
+        inner = iph + 1;
+    }
+    else if (iph->protocol == IPPROTO_GRE)
+    {
+        struct gre_base_hdr *greh = (struct gre_base_hdr *)(iph + 1);
+        if (greh + 1 > data_end)
+            return iph;
+
+        uint16_t flags = bpf_ntohs(greh->flags);
+        if (flags & GRE_VERSION)
+            return iph;
+
+        /* Optional checksum, key and sequence number fields */
+        inner = greh + 1;
+        if (flags & GRE_CSUM)
+            inner += 4;
+        if (flags & GRE_KEY)
+            inner += 4;
+        if (flags & GRE_SEQ)
+            inner += 4;
+
+        if (greh->protocol == bpf_htons(ETH_P_TEB))
+        {
+            struct ethhdr *ieth = inner;
+            if (ieth + 1 > data_end || ieth->h_proto != bpf_htons(ETH_P_IP))
+                return iph;
+            inner = ieth + 1;
+        }
+        else if (greh->protocol != bpf_htons(ETH_P_IP))
+        {
+            return iph;
+        }
+    }
+    else if (iph->protocol == IPPROTO_UDP)
+    {
+        struct udphdr *udph = (struct udphdr *)(iph + 1);
+        if (udph + 1 > data_end)
+            return iph;
+
+        uint16_t dport = bpf_ntohs(udph->dest);
+        if (!dport)
+            return iph;
+
+        if (dport == rl_config(RL_CONFIG_VXLAN_PORT))
+        {
+            struct ethhdr *ieth = (void *)(udph + 1) + VXLAN_HLEN;
+            if (ieth + 1 > data_end || ieth->h_proto != bpf_htons(ETH_P_IP))
+                return iph;
+            inner = ieth + 1;
+        }
+        else if (dport == rl_config(RL_CONFIG_GUE_PORT))
+        {
+            uint8_t *gue = (uint8_t *)(udph + 1);
+            if (gue + 4 > data_end)
+                return iph;
+
+            /* Variant 1 carries the IPv4 header right away, variant 0 has
+             * a header of 4 bytes plus hlen words of extension fields */
+            if ((gue[0] >> 6) == 1)
+                inner = gue;
+            else if ((gue[0] >> 5) == 0 && gue[1] == IPPROTO_IPIP)
+                inner = gue + 4 + (gue[0] & 0x1f) * 4;
+            else
+                return iph;
+        }
+    }
+
+    struct iphdr *inner_iph = inner;
+    if (!inner_iph || inner_iph + 1 > data_end || inner_iph->version != 4)
+        return iph;
+    return inner_iph;
+}
+
+/* Applies the traffic class policy matching the packet, if any. The
+ * destination port is matched first, then the source port and last any
+ * port of the protocol. */
+static __always_inline int rl_class(struct iphdr *iph, void *data_end,
+                                    uint64_t len)
+{
+    struct rl_class_key ckey = {
+        .proto = iph->protocol,
+        .match = RL_MATCH_DST,
+    };
+    uint16_t sport = 0;
+    struct rl_class_policy *policy;
+
+    if (iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP)
+    {
+        /* The ports are at the same offsets in both headers */
+        struct udphdr *l4 = (struct udphdr *)(iph + 1);
+        if (l4 + 1 > data_end)
+            return XDP_PASS;
+        ckey.port = bpf_ntohs(l4->dest);
+        sport = bpf_ntohs(l4->source);
+    }
+
+    policy = bpf_map_lookup_elem(&rl_class_policy_map, &ckey);
+    if (!policy && sport)
+    {
+        ckey.match = RL_MATCH_SRC;
+        ckey.port = sport;
+        policy = bpf_map_lookup_elem(&rl_class_policy_map, &ckey);
+    }
+    if (!policy && ckey.port)
+    {
+        ckey.match = RL_MATCH_DST;
+        ckey.port = 0;
+        policy = bpf_map_lookup_elem(&rl_class_policy_map, &ckey);
+    }
+    if (!policy)
+        return XDP_PASS;
+
+    uint32_t id = policy->id;
+    struct rl_window *w = bpf_map_lookup_elem(&rl_class_window_map, &id);
+    struct rl_class_stats *stats = bpf_map_lookup_elem(&rl_class_stats_map,
+                                                       &id);
+    if (!w || !stats)
+        return XDP_PASS;
+
+    uint64_t cost = policy->unit == RL_UNIT_BYTES ? len : 1;
+    int rc = rl_window_admit(w, bpf_ktime_get_ns(), policy->limit, cost);
+
+    stats->pkts++;
+    stats->bytes += len;
+    if (rc == XDP_DROP)
+    {
+        stats->drop_pkts++;
+        stats->drop_bytes += len;
+    }
+    return rc;
+}
+
+/* Computes the fingerprint of the SYN from its TTL bucket, window size,
+ * MSS, window scale and option order */
+static __always_inline void rl_fingerprint(struct iphdr *iph,
+                                           struct tcphdr *tcph,
+                                           void *data_end, struct rl_fp *fp)
+{
+    uint8_t *opt = (uint8_t *)(tcph + 1);
+    uint8_t *opt_end = (uint8_t *)tcph + tcph->doff * 4;
+    int i;
+
+    fp->ttl = iph->ttl <= 32 ? 32 : iph->ttl <= 64 ? 64 :
+        iph->ttl <= 128 ? 128 : 255;
+    fp->window = bpf_ntohs(tcph->window);
+    fp->wscale = 0xff;
+
+#pragma unroll
+    for (i = 0; i < RL_TCP_MAX_OPTIONS; i++)
+    {
+        if (opt + 1 > opt_end || opt + 1 > data_end)
+            break;
+
+        uint8_t kind = opt[0];
+        if (kind == TCPOPT_EOL)
+            break;
+
+        fp->options[i] = kind;
+        fp->nr_options++;
+        if (kind == TCPOPT_NOP)
+        {
+            opt++;
+            continue;
+        }
+
+        if (opt + 2 > data_end)
+            break;
+        uint8_t len = opt[1];
+        if (len < 2)
+            break;
+
+        if (kind == TCPOPT_MSS && len == 4 && opt + 4 <= data_end)
+            fp->mss = ((uint16_t)opt[2] << 8) | opt[3];
+        else if (kind == TCPOPT_WINDOW && len == 3 && opt + 3 <= data_end)
+            fp->wscale = opt[2];
+
+        /* Options are at most 40 bytes */
+        opt += len & 0x3f;
+    }
+}
+
+/* Ratelimits the SYNs of the fingerprint and keeps its counters for the
+ * top fingerprints export */
+static __always_inline int rl_fp_limit(struct iphdr *iph, struct tcphdr *tcph,
+                                       void *data_end, uint64_t tnow)
+{
+    struct rl_fp fp = {};
+    struct rl_fp_state *state;
+    uint64_t *limit, fp_rate;
+
+    rl_fingerprint(iph, tcph, data_end, &fp);
+    limit = bpf_map_lookup_elem(&rl_fp_limit_map, &fp);
+    fp_rate = limit ? *limit : rl_config(RL_CONFIG_FP_RATE);
+
+    state = bpf_map_lookup_elem(&rl_fp_map, &fp);
+    if (!state)
+    {
+        struct rl_fp_state init = {
+            .window.start = tnow / RL_NANO * RL_NANO,
+            .window.curr = 1,
+            .syns = 1,
+        };
+        bpf_map_update_elem(&rl_fp_map, &fp, &init, BPF_NOEXIST);
+        return XDP_PASS;
+    }
+
+    __sync_fetch_and_add(&state->syns, 1);
+    if (!fp_rate ||
+        rl_window_admit(&state->window, tnow, fp_rate, 1) == XDP_PASS)
+        return XDP_PASS;
+
+    __sync_fetch_and_add(&state->drops, 1);
+    return XDP_DROP;
+}
+
+/* Accounts a new connection of the protocol */
+static __always_inline void rl_proto_count(uint32_t proto, int rc)
+{
+    struct rl_proto_stats *stats = bpf_map_lookup_elem(&rl_proto_stats_map,
+                                                       &proto);
+    if (!stats)
+        return;
+
+    __sync_fetch_and_add(&stats->recv, 1);
+    if (rc == XDP_DROP)
+        __sync_fetch_and_add(&stats->drop, 1);
+}
+
+/* Ratelimits the QUIC connections, a new connection starts with a long
+ * header Initial packet. The same limits as for the TCP SYNs apply. */
+static __always_inline int rl_quic(struct iphdr *iph, void *data_end)
+{
+    struct udphdr *udph = (struct udphdr *)(iph + 1);
+    if (udph + 1 > data_end)
+        return XDP_PASS;
+
+    uint16_t dstport = bpf_ntohs(udph->dest);
+    uint8_t *action = bpf_map_lookup_elem(&rl_quic_ports_map, &dstport);
+    if (!action)
+        return XDP_PASS;
+
+    /* Long header with the fixed bit set followed by the version */
+    uint8_t *quic = (uint8_t *)(udph + 1);
+    if (quic + 5 > data_end)
+        return XDP_PASS;
+    if ((quic[0] & 0xc0) != 0xc0)
+        return XDP_PASS;
+
+    uint32_t version = ((uint32_t)quic[1] << 24) | ((uint32_t)quic[2] << 16) |
+        ((uint32_t)quic[3] << 8) | quic[4];
+    uint8_t type = (quic[0] >> 4) & 0x3;
+
+    /* Version negotiation */
+    if (!version)
+        return XDP_PASS;
+    if (type != (version == RL_QUIC_V2 ? RL_QUIC_TYPE_INITIAL_V2 :
+                 RL_QUIC_TYPE_INITIAL_V1))
+        return XDP_PASS;
+    /* Initial packets in undersized datagrams are discarded by servers */
+    if (bpf_ntohs(udph->len) < RL_QUIC_MIN_INITIAL_LEN)
+        return XDP_PASS;
+
+    uint64_t rkey = 0;
+    uint64_t *rate = bpf_map_lookup_elem(&rl_config_map, &rkey);
+    uint64_t *in_count = bpf_map_lookup_elem(&rl_recv_count_map, &rkey);
+    uint64_t *drop_count = bpf_map_lookup_elem(&rl_drop_count_map, &rkey);
+    if (!rate || !in_count || !drop_count)
+        return XDP_PASS;
+
+    (*in_count)++;
+
+    uint64_t tnow = bpf_ktime_get_ns();
+    uint32_t key = iph->saddr & (uint32_t)rl_config(RL_CONFIG_KEY_MASK);
+    int rc = rl_decide(key, tnow, *rate, 0);
+
+    rl_proto_count(RL_PROTO_QUIC, rc);
+    if (rc == XDP_PASS)
+        return XDP_PASS;
+
+    if (*action == RL_ACTION_MARK)
+    {
+        rl_set_dscp(iph, (uint8_t)rl_config(RL_CONFIG_MARK_DSCP));
+        return XDP_PASS;
+    }
+    if (*action == RL_ACTION_REDIRECT)
+        return rl_redirect(iph);
+
+    /* The daemon refuses the rst and xsk actions for QUIC */
+    (*drop_count)++;
+    return XDP_DROP;
+}
+
+/* TODO Use atomics or spin locks where naive increments are used depending
+ * on the accuracy tests and then do a tradeoff.
+ * With 10k connections/sec tests, the error rate is < 3%. */
+static __always_inline int _xdp_ratelimit(struct xdp_md *ctx)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+
+    struct ethhdr *eth = data;
+
+    /* Check if it is a valid ethernet packet */
+    if (data + sizeof(*eth) > data_end)
+        return XDP_DROP;
+
+    /* Ignore other than ethernet packets */
+    uint16_t eth_type = eth->h_proto;
+    if (ntohs(eth_type) != ETH_P_IP) {
+        return XDP_PASS;
+    }
+
+    /* Ignore other than IP packets */
+    struct iphdr *iph = data + sizeof(struct ethhdr);
+    if (iph + 1 > data_end)
+        return XDP_PASS;
+
+    /* The limits apply to the inner headers of the tunneled packets, the
+     * outer headers stay as they are */
+    struct iphdr *outer_iph = iph;
+    if (rl_config(RL_CONFIG_DECAP))
+        iph = rl_decap(iph, data_end);
+
+    /* Packet and byte rates of the traffic classes */
+    if (rl_config(RL_CONFIG_CLASSES) &&
+        rl_class(iph, data_end, data_end - data) == XDP_DROP)
+        return XDP_DROP;
+
+    /* New QUIC connections are ratelimited as well */
+    if (iph->protocol == IPPROTO_UDP)
+        return rl_quic(iph, data_end);
+
+    /* Ignore other than TCP packets */
+    if (iph->protocol != IPPROTO_TCP)
+        return XDP_PASS;
+
+    /* Check if its valid tcp packet */
+    struct tcphdr *tcph = (struct tcphdr *)(iph + 1);
+    if (tcph + 1 > data_end)
+        return XDP_PASS;
+
+    /* Ignore other than TCP-SYN packets, the others are only looked at to
+     * track the handshakes and the established connections */
+    if (!(tcph->syn & TCP_FLAGS)) {
+        if (rl_config(RL_CONFIG_MARK_FLOW))
+            rl_mark_flow(iph, tcph);
+        rl_track_flow(iph, tcph);
+        return XDP_PASS;
+    }
+
+    /* Ignore TCP-SYN-ACK packets */
+    if (tcph->ack & TCP_FLAGS)
+        return XDP_PASS;
+
+    /* Action to be taken on the connections over the limit */
+    uint16_t dstport = bpf_ntohs(tcph->dest);
+    uint8_t *action = bpf_map_lookup_elem(&rl_ports_map, &dstport);
+    if(!action)
+        return XDP_PASS;
+
+    uint64_t rkey = 0;
+    uint64_t *rate = bpf_map_lookup_elem(&rl_config_map, &rkey);
+
+    if (!rate)
+        return XDP_PASS;
+
+    /* Current time in monotonic clock */
+    uint64_t tnow = bpf_ktime_get_ns();
+
+    /* Total number of incoming connections so far */
+    uint64_t *in_count = bpf_map_lookup_elem(&rl_recv_count_map, &rkey);
+
+    /* Total number of dropped connections so far */
+    uint64_t *drop_count = bpf_map_lookup_elem(&rl_drop_count_map, &rkey);
+
+    /* Total number of retransmitted connections so far */
+    uint64_t *retrans_count = bpf_map_lookup_elem(&rl_retrans_count_map,
+                                                  &rkey);
+
+    /* Just make the verifier happy, it would never be the case in real as
+     * these counters are initialised in the user space. */
+    if(!in_count || !drop_count || !retrans_count)
+        return XDP_PASS;
+
+    /* A SYN matching a recently dropped one(same 4-tuple and ISN) is the
+     * retransmission of a real client as spoofed floods do not retransmit,
+     * count it separately and give it priority. */
+    uint64_t track_retrans = rl_config(RL_CONFIG_RETRANS);
+    struct rl_syn_key syn_key = {};
+    int retrans = 0;
+
+    if (track_retrans)
+    {
+        syn_key.saddr = iph->saddr;
+        syn_key.daddr = iph->daddr;
+        syn_key.sport = tcph->source;
+        syn_key.dport = tcph->dest;
+        syn_key.seq = tcph->seq;
+
+        uint64_t *dropped_at = bpf_map_lookup_elem(&rl_retrans_map, &syn_key);
+        if (dropped_at && tnow - *dropped_at >= RL_RETRANS_MIN_GAP_NS)
+            retrans = 1;
+    }
+
+    /* Admitted SYNs are tracked till the end of their handshake when the
+     * reputation, the half-open or the established connections are needed */
+    uint64_t track_reputation = rl_config(RL_CONFIG_REPUTATION);
+    uint64_t halfopen_max = rl_config(RL_CONFIG_HALFOPEN_MAX);
+    uint64_t max_concurrent = rl_config(RL_CONFIG_MAX_CONCURRENT);
+    uint32_t saddr = iph->saddr;
+    struct rl_port_stats *stats = NULL;
+    int known = 0;
+
+    if (rl_config(RL_CONFIG_TRACK_HANDSHAKE))
+    {
+        stats = bpf_map_lookup_elem(&rl_port_stats_map, &dstport);
+        if (stats)
+            __sync_fetch_and_add(&stats->syns, 1);
+    }
+
+    /* Sources that recently completed a handshake are known-good, they get
+     * priority over the unknown sources. */
+    if (track_reputation)
+    {
+        uint64_t *completed_at = bpf_map_lookup_elem(&rl_reputation_map,
+                                                     &saddr);
+        if (completed_at &&
+            tnow - *completed_at < rl_config(RL_CONFIG_REPUTATION_TTL))
+            known = 1;
+    }
+
+    /* Increment the total number of incoming connections counter */
+    if (retrans)
+        (*retrans_count)++;
+    else
+        (*in_count)++;
+
+    uint32_t key = iph->saddr & (uint32_t)rl_config(RL_CONFIG_KEY_MASK);
+    int rc;
+
+    /* Sources holding too many half-open connections, services at their
+     * concurrency limit and fingerprints over their rate are dropped before
+     * they consume the budget */
+    if (halfopen_max && rl_halfopen_full(saddr, tnow, halfopen_max))
+        rc = XDP_DROP;
+    else if (max_concurrent &&
+             rl_concurrency_full(iph, tcph, max_concurrent))
+        rc = XDP_DROP;
+    else if (rl_config(RL_CONFIG_FP) &&
+             rl_fp_limit(iph, tcph, data_end, tnow) == XDP_DROP)
+        rc = XDP_DROP;
+    else if (rl_config(RL_CONFIG_PREMIUM_RATE) && rl_dscp_reserved(iph, tnow))
+        rc = XDP_PASS;
+    else
+        rc = rl_decide(key, tnow, *rate, retrans || known);
+
+    rl_proto_count(RL_PROTO_TCP, rc);
+    if (rl_config(RL_CONFIG_QUEUE_STATS))
+        rl_queue_count(ctx, rc, tnow);
+    if (rc == XDP_DROP && rl_config(RL_CONFIG_HOT_KEYS))
+        rl_hot_add(key, tnow);
+
+    if (rc == XDP_DROP && *action == RL_ACTION_MARK)
+    {
+        /* Soft enforcement, pass the connection with the scavenger DSCP so
+         * downstream queues deprioritize it instead of failing it */
+        uint8_t dscp = (uint8_t)rl_config(RL_CONFIG_MARK_DSCP);
+
+        rl_set_dscp(iph, dscp);
+        if (rl_config(RL_CONFIG_MARK_FLOW))
+        {
+            struct rl_flow_key fkey = {
+                .saddr = iph->saddr,
+                .daddr = iph->daddr,
+                .sport = tcph->source,
+                .dport = tcph->dest,
+            };
+            bpf_map_update_elem(&rl_mark_flow_map, &fkey, &dscp, BPF_ANY);
+        }
+
+        uint64_t *mark_count = bpf_map_lookup_elem(&rl_mark_count_map, &rkey);
+        if (mark_count)
+            (*mark_count)++;
+        return XDP_PASS;
+    }
+
+    if (rc == XDP_DROP && *action == RL_ACTION_REDIRECT)
+        return rl_redirect(iph);
+
+    /* Dropped below when no engine is bound to the queue, the kernels
+     * without a fallback action in the flags return XDP_ABORTED then */
+    if (rc == XDP_DROP && *action == RL_ACTION_XSK &&
+        bpf_redirect_map(&rl_xsk_map, ctx->rx_queue_index,
+                         rl_config(RL_CONFIG_XSK_FLAGS)) == XDP_REDIRECT)
+    {
+        uint64_t *xsk_count = bpf_map_lookup_elem(&rl_xsk_count_map, &rkey);
+        if (xsk_count)
+            (*xsk_count)++;
+        return XDP_REDIRECT;
+    }
+
+    if (rc == XDP_DROP)
+    {
+        (*drop_count)++;
+        if (track_retrans)
+            bpf_map_update_elem(&rl_retrans_map, &syn_key, &tnow, BPF_ANY);
+        /* RSTs cannot be sent back through the tunnel */
+        if (*action == RL_ACTION_RST && iph == outer_iph)
+            rc = rl_reject_rst(ctx, eth, iph, tcph, tnow);
+    }
+    else
+    {
+        if (retrans)
+            bpf_map_delete_elem(&rl_retrans_map, &syn_key);
+
+        if (stats)
+        {
+            /* Wait for the final ACK of the handshake */
+            struct rl_flow_key fkey = {
+                .saddr = iph->saddr,
+                .daddr = iph->daddr,
+                .sport = tcph->source,
+                .dport = tcph->dest,
+            };
+            struct rl_flow_state flow = {
+                .ts = tnow,
+                .isn = bpf_ntohl(tcph->seq),
+            };
+            __sync_fetch_and_add(&stats->admitted, 1);
+            if (!bpf_map_update_elem(&rl_syn_flow_map, &fkey, &flow,
+                                     BPF_NOEXIST))
+            {
+                if (halfopen_max)
+                    rl_halfopen_add(saddr, tnow);
+            }
+            else
+            {
+                /* A retransmitted SYN keeps its handshake, already counted
+                 * as outstanding. A new ISN on the tuple restarts it. */
+                struct rl_flow_state *prev =
+                    bpf_map_lookup_elem(&rl_syn_flow_map, &fkey);
+
+                if (prev && prev->isn != flow.isn)
+                    bpf_map_update_elem(&rl_syn_flow_map, &fkey, &flow,
+                                        BPF_EXIST);
+            }
+        }
+    }
+    return rc;
+}
+
 SEC("xdp_ratelimiting")
 int _xdp_ratelimiting(struct xdp_md *ctx)
 {
    int rc = _xdp_ratelimit(ctx);
 
-   if (rc == XDP_DROP) {
-      return XDP_DROP;
+   if (rc != XDP_PASS) {
+      return rc;
    }
 
    bpf_tail_call(ctx, &xdp_rl_ingress_next_prog, 0);
@@ -0,0 +1,714 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Header-only C++ limiter for the proxies, with the admission algorithms of
+ * the XDP program so the L7 limits behave as the L4 ones. The algorithm
+ * and the key type are template parameters:
+ *
+ *   rl::limiter<rl::sliding_window, uint32_t> per_source(1000);
+ *   if (!per_source.admit(saddr))
+ *       reject();
+ *
+ * The times are CLOCK_MONOTONIC ns, the clock of bpf_ktime_get_ns(). */
+
+#ifndef RATELIMITING_LIMITER_HPP
+#define RATELIMITING_LIMITER_HPP
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/bpf.h>
+#include <linux/types.h>
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#include "ratelimiting_common.h"
+#include "ratelimiting_window.h"
+
+namespace rl {
+
+/* Size of a cache line, the unit the concurrent state is spread over */
+static const size_t cache_line = 64;
+
+/* Threads with a counter slot of their own, the threads past it share */
+static const size_t max_threads = 256;
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * RL_NANO + ts.tv_nsec;
+}
+
+/* Rate and burst of a limiter, derived the way the daemon configures the
+ * XDP program */
+struct config {
+    uint64_t rate;              /* Per second */
+    uint64_t interval;          /* GCRA emission interval in ns */
+    uint64_t tolerance;         /* GCRA burst tolerance in ns */
+
+    /* The burst defaults to one second worth of requests */
+    explicit config(uint64_t rate, uint64_t burst = 0)
+        : rate(rate), interval(0), tolerance(0)
+    {
+        if (!rate)
+            return;
+        interval = RL_NANO / rate;
+        if (!burst)
+            burst = rate;
+        tolerance = (burst - 1) * interval;
+    }
+};
+
+/* Sliding window of the --mode window and the traffic classes */
+struct sliding_window {
+    typedef struct rl_window state;
+
+    static bool admit(state &s, uint64_t tnow, const config &c)
+    {
+        return rl_window_admit(&s, tnow, c.rate, 1) == XDP_PASS;
+    }
+};
+
+/* GCRA of the --mode gcra, the state is the theoretical arrival time */
+struct gcra {
+    typedef uint64_t state;
+
+    static bool admit(state &tat, uint64_t tnow, const config &c)
+    {
+        return rl_gcra_admit(&tat, tnow, c.interval, c.tolerance) ==
+            XDP_PASS;
+    }
+};
+
+/* Admitted and dropped requests. Each thread increments the counters of
+ * its own cache line, so the threads never contend on them, the totals
+ * are summed on read. */
+class counters {
+public:
+    void add(bool admitted)
+    {
+        slot &s = slots_[thread_slot()];
+
+        (admitted ? s.admitted : s.dropped).fetch_add(
+            1, std::memory_order_relaxed);
+    }
+
+    uint64_t admitted() const { return sum(&slot::admitted); }
+    uint64_t dropped() const { return sum(&slot::dropped); }
+
+private:
+    struct alignas(cache_line) slot {
+        std::atomic<uint64_t> admitted{0};
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    static size_t thread_slot()
+    {
+        static std::atomic<size_t> next{0};
+        thread_local size_t idx = next.fetch_add(1) % max_threads;
+
+        return idx;
+    }
+
+    uint64_t sum(std::atomic<uint64_t> slot::*counter) const
+    {
+        uint64_t total = 0;
+
+        for (const slot &s : slots_)
+            total += (s.*counter).load(std::memory_order_relaxed);
+        return total;
+    }
+
+    slot slots_[max_threads];
+};
+
+/* State of the keys spread over Shards independently locked hash tables.
+ * A key is only locked against the keys of its shard, and the shards are
+ * on cache lines of their own. */
+template <typename Key, typename State, typename Hash = std::hash<Key>,
+          size_t Shards = 64>
+class sharded_table {
+public:
+    /* Calls f on the state of key, created zeroed for a new key, under the
+     * lock of its shard and returns its result */
+    template <typename F>
+    bool update(const Key &key, uint64_t tnow, F f)
+    {
+        shard &s = shard_of(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        entry &e = s.map[key];
+
+        e.last_seen = tnow;
+        return f(e.state);
+    }
+
+    /* Removes the keys not seen since before, returns their number */
+    size_t expire(uint64_t before)
+    {
+        size_t removed = 0;
+
+        for (shard &s : shards_) {
+            std::lock_guard<std::mutex> guard(s.lock);
+
+            for (auto it = s.map.begin(); it != s.map.end();) {
+                if (it->second.last_seen < before) {
+                    it = s.map.erase(it);
+                    removed++;
+                } else {
+                    ++it;
+                }
+            }
+        }
+        return removed;
+    }
+
+    size_t size()
+    {
+        size_t total = 0;
+
+        for (shard &s : shards_) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            total += s.map.size();
+        }
+        return total;
+    }
+
+private:
+    struct entry {
+        State state{};
+        uint64_t last_seen = 0;
+    };
+
+    struct alignas(cache_line) shard {
+        std::mutex lock;
+        std::unordered_map<Key, entry, Hash> map;
+    };
+
+    shard &shard_of(const Key &key)
+    {
+        /* Mixed, as std::hash of the integers is the identity */
+        uint64_t h = Hash()(key) * 0x9e3779b97f4a7c15ULL;
+
+        return shards_[(h >> 32) % Shards];
+    }
+
+    shard shards_[Shards];
+};
+
+/* Epoch based reclamation of the memory the lock-free readers may still
+ * hold. A reader announces the epoch it entered in and the memory retired
+ * in an epoch is freed once no reader of that epoch or an older one is
+ * left. One domain serves every table of the process. */
+class epoch {
+    struct record;
+
+public:
+    /* Reader section, nests */
+    class guard {
+    public:
+        guard() : rec_(epoch::get().enter()) {}
+        ~guard() { epoch::get().leave(rec_); }
+        guard(const guard &) = delete;
+        guard &operator=(const guard &) = delete;
+
+    private:
+        record *rec_;
+    };
+
+    static epoch &get()
+    {
+        static epoch domain;
+
+        return domain;
+    }
+
+    /* Frees p with free once the readers of the current epoch left, to be
+     * called after p was unlinked */
+    void retire(void *p, void (*free)(void *))
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t e = epoch_.load();
+        std::lock_guard<std::mutex> guard(lock_);
+
+        retired_.push_back({p, free, e});
+    }
+
+    /* Starts a new epoch and frees what no reader can hold anymore,
+     * returns the number of pointers freed */
+    size_t reclaim()
+    {
+        uint64_t safe = epoch_.fetch_add(1) + 1;
+        std::vector<retired> ready;
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (record *r = records_.load(std::memory_order_acquire); r;
+             r = r->next) {
+            uint64_t active = r->active.load(std::memory_order_relaxed);
+
+            if (active && active < safe)
+                safe = active;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            size_t kept = 0;
+
+            for (retired &r : retired_) {
+                if (r.epoch < safe)
+                    ready.push_back(r);
+                else
+                    retired_[kept++] = r;
+            }
+            retired_.resize(kept);
+        }
+        for (retired &r : ready)
+            r.free(r.p);
+        return ready.size();
+    }
+
+    ~epoch()
+    {
+        record *next;
+
+        /* The threads are gone by now */
+        for (retired &r : retired_)
+            r.free(r.p);
+        for (record *r = records_.load(); r; r = next) {
+            next = r->next;
+            delete r;
+        }
+    }
+
+private:
+    struct retired {
+        void *p;
+        void (*free)(void *);
+        uint64_t epoch;
+    };
+
+    /* Announce of a thread, 0 out of the reader sections. Released to the
+     * next thread when its thread exits. */
+    struct alignas(cache_line) record {
+        std::atomic<uint64_t> active{0};
+        std::atomic<bool> used{true};
+        unsigned int depth = 0;
+        record *next = nullptr;
+    };
+
+    struct owner {
+        record *rec;
+
+        ~owner() { rec->used.store(false, std::memory_order_release); }
+    };
+
+    epoch() = default;
+
+    record *self()
+    {
+        thread_local owner o{acquire()};
+
+        return o.rec;
+    }
+
+    record *acquire()
+    {
+        record *r;
+
+        for (r = records_.load(std::memory_order_acquire); r; r = r->next) {
+            bool used = false;
+
+            if (!r->used.load(std::memory_order_relaxed) &&
+                r->used.compare_exchange_strong(used, true))
+                return r;
+        }
+        r = new record;
+        r->next = records_.load(std::memory_order_relaxed);
+        while (!records_.compare_exchange_weak(r->next, r,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed))
+            ;
+        return r;
+    }
+
+    record *enter()
+    {
+        record *r = self();
+
+        if (!r->depth++) {
+            r->active.store(epoch_.load(), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        return r;
+    }
+
+    void leave(record *r)
+    {
+        if (!--r->depth)
+            r->active.store(0, std::memory_order_release);
+    }
+
+    std::atomic<uint64_t> epoch_{1};
+    std::atomic<record *> records_{nullptr};
+    std::mutex lock_;
+    std::vector<retired> retired_;
+};
+
+/* State of the keys in Shards open addressing tables, for the hot paths
+ * that can't wait on a lock. The slots are grouped by buckets of a cache
+ * line, the key of a slot is told by a 16 bits tag of its hash before its
+ * entry is read. A key is looked up without a lock, only the insertions,
+ * the expiry and the resizes lock their shard, the entries and the tables
+ * they unlink are freed by the epoch.
+ *
+ * The state of a key is updated under a spinlock of its entry, held for
+ * the few instructions of the algorithm, so the threads only wait on each
+ * other for the same key. */
+template <typename Key, typename State, typename Hash = std::hash<Key>,
+          size_t Shards = 64>
+class concurrent_table {
+public:
+    concurrent_table()
+    {
+        for (shard &s : shards_)
+            s.slots.store(new table(min_buckets), std::memory_order_relaxed);
+    }
+
+    /* Nothing may use the table anymore */
+    ~concurrent_table()
+    {
+        for (shard &s : shards_) {
+            table *t = s.slots.load(std::memory_order_relaxed);
+
+            for (size_t i = 0; i <= t->mask; i++) {
+                for (size_t j = 0; j < bucket_slots; j++) {
+                    entry *e = t->buckets[i].entries[j].load(
+                        std::memory_order_relaxed);
+
+                    if (e && e != tombstone())
+                        delete e;
+                }
+            }
+            delete t;
+        }
+    }
+
+    concurrent_table(const concurrent_table &) = delete;
+    concurrent_table &operator=(const concurrent_table &) = delete;
+
+    /* Calls f on the state of key, created zeroed for a new key, and
+     * returns its result */
+    template <typename F>
+    bool update(const Key &key, uint64_t tnow, F f)
+    {
+        uint64_t h = hash(key);
+        shard &s = shards_[(h >> 48) % Shards];
+        epoch::guard guard;
+        entry *e = find(s.slots.load(std::memory_order_acquire), key, h);
+
+        if (!e)
+            e = insert(s, key, h);
+        e->last_seen.store(tnow, std::memory_order_relaxed);
+
+        while (e->busy.test_and_set(std::memory_order_acquire))
+            ;
+        bool ret = f(e->state);
+
+        e->busy.clear(std::memory_order_release);
+        return ret;
+    }
+
+    /* Removes the keys not seen since before, returns their number */
+    size_t expire(uint64_t before)
+    {
+        size_t removed = 0;
+
+        for (shard &s : shards_) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            table *t = s.slots.load(std::memory_order_relaxed);
+
+            for (size_t i = 0; i <= t->mask; i++) {
+                bucket &b = t->buckets[i];
+
+                for (size_t j = 0; j < bucket_slots; j++) {
+                    entry *e = b.entries[j].load(std::memory_order_relaxed);
+
+                    if (!e || e == tombstone() ||
+                        e->last_seen.load(std::memory_order_relaxed) >=
+                            before)
+                        continue;
+                    b.entries[j].store(tombstone(),
+                                       std::memory_order_release);
+                    epoch::get().retire(e, free_entry);
+                    s.live--;
+                    removed++;
+                }
+            }
+            /* The tombstones lengthen the probes, and the table shrinks
+             * back once the keys left */
+            if ((s.used - s.live) * 4 > t->capacity())
+                rehash(s, t, s.live);
+        }
+        epoch::get().reclaim();
+        return removed;
+    }
+
+    size_t size()
+    {
+        size_t total = 0;
+
+        for (shard &s : shards_) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            total += s.live;
+        }
+        return total;
+    }
+
+private:
+    struct entry {
+        const Key key;
+        State state{};
+        std::atomic<uint64_t> last_seen{0};
+        std::atomic_flag busy = ATOMIC_FLAG_INIT;   /* Lock of state */
+
+        explicit entry(const Key &key) : key(key) {}
+    };
+
+    /* 6 slots of a 16 bits tag and an entry fill a cache line */
+    static const size_t bucket_slots = 6;
+
+    struct alignas(cache_line) bucket {
+        std::atomic<uint16_t> tags[bucket_slots]{};
+        std::atomic<entry *> entries[bucket_slots]{};
+    };
+    static_assert(sizeof(bucket) == cache_line, "bucket is not a line");
+
+    struct table {
+        size_t mask;
+        bucket *buckets;
+
+        explicit table(size_t n) : mask(n - 1), buckets(new bucket[n]) {}
+        ~table() { delete[] buckets; }
+        size_t capacity() const { return (mask + 1) * bucket_slots; }
+    };
+
+    struct alignas(cache_line) shard {
+        std::atomic<table *> slots{nullptr};
+        std::mutex lock;
+        size_t live = 0;                /* Keys */
+        size_t used = 0;                /* Keys and tombstones */
+    };
+
+    static const size_t min_buckets = 16;
+
+    /* An unlinked entry, ends no probe */
+    static entry *tombstone() { return reinterpret_cast<entry *>(1); }
+
+    static void free_entry(void *p) { delete static_cast<entry *>(p); }
+    static void free_table(void *p) { delete static_cast<table *>(p); }
+
+    static uint64_t hash(const Key &key)
+    {
+        /* Finalizer of MurmurHash3, std::hash of the integers is the
+         * identity and the shard, the tag and the bucket take different
+         * bits of it */
+        uint64_t h = Hash()(key);
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static uint16_t tag_of(uint64_t h) { return h >> 32; }
+
+    /* Lock-free lookup, the probe ends at the first empty slot */
+    static entry *find(table *t, const Key &key, uint64_t h)
+    {
+        uint16_t tag = tag_of(h);
+
+        for (size_t i = h & t->mask, n = 0; n <= t->mask;
+             i = (i + 1) & t->mask, n++) {
+            bucket &b = t->buckets[i];
+
+            for (size_t j = 0; j < bucket_slots; j++) {
+                entry *e = b.entries[j].load(std::memory_order_acquire);
+
+                if (!e)
+                    return nullptr;
+                if (e != tombstone() &&
+                    b.tags[j].load(std::memory_order_relaxed) == tag &&
+                    e->key == key)
+                    return e;
+            }
+        }
+        return nullptr;
+    }
+
+    /* Under the lock of the shard, finds key or the slot to insert it in,
+     * the first tombstone of the probe or the empty slot ending it */
+    static entry *locate(table *t, const Key &key, uint64_t h,
+                         bucket *&slot_bucket, size_t &slot)
+    {
+        uint16_t tag = tag_of(h);
+
+        slot_bucket = nullptr;
+        slot = 0;
+        for (size_t i = h & t->mask;; i = (i + 1) & t->mask) {
+            bucket &b = t->buckets[i];
+
+            for (size_t j = 0; j < bucket_slots; j++) {
+                entry *e = b.entries[j].load(std::memory_order_relaxed);
+
+                if (e == tombstone()) {
+                    if (!slot_bucket) {
+                        slot_bucket = &b;
+                        slot = j;
+                    }
+                    continue;
+                }
+                if (!e) {
+                    if (!slot_bucket) {
+                        slot_bucket = &b;
+                        slot = j;
+                    }
+                    return nullptr;
+                }
+                if (b.tags[j].load(std::memory_order_relaxed) == tag &&
+                    e->key == key)
+                    return e;
+            }
+        }
+    }
+
+    /* Publishes e in the slot, the tag first so a reader seeing e reads
+     * its tag */
+    static void publish(bucket &b, size_t slot, entry *e, uint64_t h)
+    {
+        b.tags[slot].store(tag_of(h), std::memory_order_relaxed);
+        b.entries[slot].store(e, std::memory_order_release);
+    }
+
+    entry *insert(shard &s, const Key &key, uint64_t h)
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        table *t = s.slots.load(std::memory_order_relaxed);
+        bucket *b;
+        size_t slot;
+        entry *e = locate(t, key, h, b, slot);
+
+        /* Inserted since the lookup */
+        if (e)
+            return e;
+
+        /* Kept under 3/4 full so that the probes end soon */
+        if (!b->entries[slot].load(std::memory_order_relaxed) &&
+            (s.used + 1) * 4 > t->capacity() * 3) {
+            t = rehash(s, t, s.live + 1);
+            locate(t, key, h, b, slot);
+        }
+        if (!b->entries[slot].load(std::memory_order_relaxed))
+            s.used++;
+        s.live++;
+        e = new entry(key);
+        publish(*b, slot, e, h);
+        return e;
+    }
+
+    /* Moves the keys of the shard to a table at most half full for keys
+     * keys, without the tombstones. The readers of the old table find the
+     * same entries until the epoch frees it. */
+    table *rehash(shard &s, table *old, size_t keys)
+    {
+        size_t n = min_buckets;
+
+        while (n * bucket_slots < keys * 2)
+            n *= 2;
+
+        table *t = new table(n);
+
+        for (size_t i = 0; i <= old->mask; i++) {
+            bucket &from = old->buckets[i];
+
+            for (size_t j = 0; j < bucket_slots; j++) {
+                entry *e = from.entries[j].load(std::memory_order_relaxed);
+                uint64_t h;
+                bucket *b;
+                size_t slot;
+
+                if (!e || e == tombstone())
+                    continue;
+                h = hash(e->key);
+                locate(t, e->key, h, b, slot);
+                publish(*b, slot, e, h);
+            }
+        }
+        s.slots.store(t, std::memory_order_release);
+        s.used = s.live;
+        epoch::get().retire(old, free_table);
+        epoch::get().reclaim();
+        return t;
+    }
+
+    shard shards_[Shards];
+};
+
+/* Limiter of Algorithm per Key, the state is kept in Table */
+template <typename Algorithm, typename Key, typename Hash = std::hash<Key>,
+          typename Table = sharded_table<Key, typename Algorithm::state,
+                                         Hash>>
+class limiter {
+public:
+    explicit limiter(uint64_t rate, uint64_t burst = 0)
+        : config_(rate, burst)
+    {
+    }
+
+    bool admit(const Key &key, uint64_t tnow)
+    {
+        const config &c = config_;
+        bool admitted = table_.update(key, tnow,
+            [tnow, &c](typename Algorithm::state &s) {
+                return Algorithm::admit(s, tnow, c);
+            });
+
+        counters_.add(admitted);
+        return admitted;
+    }
+
+    bool admit(const Key &key) { return admit(key, now_ns()); }
+
+    /* Forgets the keys idle for idle ns, to be called periodically as the
+     * daemon sweeps the maps */
+    size_t expire(uint64_t idle)
+    {
+        uint64_t tnow = now_ns();
+
+        return table_.expire(tnow > idle ? tnow - idle : 0);
+    }
+
+    uint64_t admitted() const { return counters_.admitted(); }
+    uint64_t dropped() const { return counters_.dropped(); }
+    size_t keys() { return table_.size(); }
+
+private:
+    const config config_;
+    Table table_;
+    counters counters_;
+};
+
+}
+
+#endif
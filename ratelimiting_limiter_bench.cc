@@ -0,0 +1,164 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Throughput of the C++ limiter over the number of threads, with Google
+ * Benchmark. A single key shows the cost of a contended key, like the
+ * global window of the XDP program, the per source keys the scaling of the
+ * sharded table. The tables are also compared at 10M keys against a
+ * std::unordered_map behind a mutex, and BM_reclaim expires the keys of
+ * the concurrent table under its readers.
+ *
+ * Usage: ratelimiting_limiter_bench [--benchmark_filter=<regex>] */
+
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <benchmark/benchmark.h>
+
+#include "ratelimiting_limiter.hpp"
+
+/* Sources drawn by the threads, as many as the XDP maps hold by default */
+static const uint32_t nr_keys = RL_MAX_KEYS_DEFAULT;
+
+/* High enough for most requests to be admitted, the admitted path is the
+ * longer one */
+static const uint64_t rate = 1000000000;
+
+/* 1, 2, 4... threads up to the number of CPUs */
+static void thread_counts(benchmark::internal::Benchmark *b)
+{
+    unsigned int cpus = std::thread::hardware_concurrency();
+    unsigned int n;
+
+    for (n = 1; n < cpus; n *= 2)
+        b->Threads(n);
+    b->Threads(cpus ? cpus : 1);
+    b->UseRealTime();
+}
+
+static void BM_counters(benchmark::State &state)
+{
+    static rl::counters counters;
+
+    for (auto _ : state)
+        counters.add(true);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_counters)->Apply(thread_counts);
+
+template <typename Algorithm>
+static void BM_single_key(benchmark::State &state)
+{
+    static rl::limiter<Algorithm, uint32_t> limiter(rate);
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(limiter.admit(0));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_single_key, rl::sliding_window)->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_single_key, rl::gcra)->Apply(thread_counts);
+
+template <typename Algorithm>
+static void BM_per_source(benchmark::State &state)
+{
+    static rl::limiter<Algorithm, uint32_t> limiter(rate);
+    /* xorshift, seeded per thread */
+    uint32_t x = 2463534242U + state.thread_index();
+
+    for (auto _ : state) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        benchmark::DoNotOptimize(limiter.admit(x % nr_keys));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_per_source, rl::sliding_window)->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_per_source, rl::gcra)->Apply(thread_counts);
+
+/* Keys of the table benchmarks, filled before the first run */
+static const uint32_t nr_table_keys = 10000000;
+
+/* The baseline, one std::unordered_map behind one mutex */
+template <typename Key, typename State>
+class locked_table {
+public:
+    template <typename F>
+    bool update(const Key &key, uint64_t tnow, F f)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        entry &e = map_[key];
+
+        e.last_seen = tnow;
+        return f(e.state);
+    }
+
+    size_t expire(uint64_t) { return 0; }
+    size_t size() { return map_.size(); }
+
+private:
+    struct entry {
+        State state{};
+        uint64_t last_seen = 0;
+    };
+
+    std::mutex lock_;
+    std::unordered_map<Key, entry> map_;
+};
+
+template <typename Table>
+static void BM_table(benchmark::State &state)
+{
+    typedef rl::limiter<rl::gcra, uint32_t, std::hash<uint32_t>, Table>
+        limiter_t;
+    /* Kept over the runs, filling it takes seconds */
+    static limiter_t *limiter;
+    uint32_t x = 2463534242U + state.thread_index();
+
+    if (!state.thread_index() && !limiter) {
+        limiter = new limiter_t(rate);
+        for (uint32_t key = 0; key < nr_table_keys; key++)
+            limiter->admit(key);
+    }
+    for (auto _ : state) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        benchmark::DoNotOptimize(limiter->admit(x % nr_table_keys));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_table, locked_table<uint32_t, uint64_t>)
+    ->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_table, rl::sharded_table<uint32_t, uint64_t>)
+    ->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_table, rl::concurrent_table<uint32_t, uint64_t>)
+    ->Apply(thread_counts);
+
+/* Reclamation under load: the first thread expires every key each 4096
+ * admissions while the others keep admitting, so the entries and the
+ * tables are freed under the readers. At least 2 threads whatever the
+ * CPUs, for the preemption to interleave them. Run it from a build with
+ * -fsanitize=address to check the epoch. */
+static void BM_reclaim(benchmark::State &state)
+{
+    typedef rl::limiter<rl::gcra, uint32_t, std::hash<uint32_t>,
+                        rl::concurrent_table<uint32_t, uint64_t>> limiter_t;
+    static limiter_t limiter(rate);
+    uint32_t x = 2463534242U + state.thread_index();
+    uint64_t n = 0;
+
+    for (auto _ : state) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        benchmark::DoNotOptimize(limiter.admit(x % 65536));
+        if (!state.thread_index() && ++n % 4096 == 0)
+            limiter.expire(0);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_reclaim)->Threads(2)->Threads(4)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,147 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Export of the per CPU maps: the reads of the keys with the values of all
+ * the CPUs and the reduction of the values, shared by the daemon and its
+ * benchmark */
+
+#ifndef RATELIMITING_REDUCE_H
+#define RATELIMITING_REDUCE_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/types.h>
+
+#include "bpf_util.h"
+#include "bpf/bpf.h"
+
+#include "constants.h"
+#include "ratelimiting_common.h"
+
+typedef void (*percpu_batch_cb)(const void *keys, const void *values,
+                                __u32 count, void *arg);
+
+/* Size of the values of one key, the kernel aligns the value of every CPU
+ * on 8 bytes */
+static inline size_t rl_percpu_stride(__u32 value_size)
+{
+    return bpf_num_possible_cpus() * ((value_size + 7) & ~7U);
+}
+
+/* Walk of the keys with one lookup per key, two system calls per key.
+ * Returns the number of keys read. */
+static inline int rl_read_percpu_keys(int fd, __u32 key_size,
+                                      __u32 value_size, percpu_batch_cb cb,
+                                      void *arg, char *keys, char *values)
+{
+    size_t stride = rl_percpu_stride(value_size);
+    char *prev_key = malloc(key_size);
+    int has_key = 0, total = 0;
+    __u32 count = 0;
+
+    if (!prev_key)
+        return -1;
+    while (!bpf_map_get_next_key(fd, has_key ? prev_key : NULL,
+                                 keys + count * key_size))
+    {
+        memcpy(prev_key, keys + count * key_size, key_size);
+        has_key = 1;
+        if (bpf_map_lookup_elem(fd, keys + count * key_size,
+                                values + count * stride))
+            continue;
+        if (++count == EXPORT_BATCH) {
+            cb(keys, values, count, arg);
+            total += count;
+            count = 0;
+        }
+    }
+    if (count) {
+        cb(keys, values, count, arg);
+        total += count;
+    }
+    free(prev_key);
+    return total;
+}
+
+#ifdef HAVE_BPF_MAP_BATCH
+/* One system call per batch, kernel 5.6 and later. Returns the number of
+ * keys read, -EINVAL when the kernel has no batch operations. */
+static inline int rl_read_percpu_batch(int fd, __u32 key_size,
+                                       __u32 value_size, percpu_batch_cb cb,
+                                       void *arg, char *keys, char *values)
+{
+    DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    void *in_batch = NULL;
+    __u64 batch = 0;
+    int ret, total = 0;
+    __u32 count;
+
+    do {
+        count = EXPORT_BATCH;
+        ret = bpf_map_lookup_batch(fd, in_batch, &batch, keys, values,
+                                   &count, &opts);
+        if (ret && errno != ENOENT)
+            return !in_batch && errno == EINVAL ? -EINVAL : -1;
+        if (count) {
+            cb(keys, values, count, arg);
+            total += count;
+        }
+        in_batch = &batch;
+    } while (!ret);
+    return total;
+}
+#endif
+
+/* Read the keys of a per CPU hash map with the values of all the CPUs, in
+ * batches of EXPORT_BATCH keys handed to cb. With HAVE_BPF_MAP_BATCH a
+ * batch takes a single system call, on kernels without the batch
+ * operations the keys are walked one by one. Returns the number of keys
+ * read, -1 on error. */
+static inline int read_percpu_map(int fd, __u32 key_size, __u32 value_size,
+                                  percpu_batch_cb cb, void *arg)
+{
+    char *keys, *values;
+    int total = -1;
+
+    keys = malloc((size_t)EXPORT_BATCH * key_size);
+    values = malloc(EXPORT_BATCH * rl_percpu_stride(value_size));
+    if (!keys || !values)
+        goto out;
+
+#ifdef HAVE_BPF_MAP_BATCH
+    total = rl_read_percpu_batch(fd, key_size, value_size, cb, arg, keys,
+                                 values);
+    if (total != -EINVAL)
+        goto out;
+#endif
+    total = rl_read_percpu_keys(fd, key_size, value_size, cb, arg, keys,
+                                values);
+out:
+    free(keys);
+    free(values);
+    return total < 0 ? -1 : total;
+}
+
+/* Sums the drops and takes the latest last seen time of the nr_cpus values
+ * of key, skipping the slots left over by another key */
+static inline void rl_reduce_hot_key(const struct rl_hot_key *values,
+                                     unsigned int nr_cpus, __u32 key,
+                                     struct rl_hot_key *out)
+{
+    unsigned int cpu;
+
+    out->drops = 0;
+    out->last_seen = 0;
+    for (cpu = 0; cpu < nr_cpus; cpu++) {
+        if (values[cpu].key != key)
+            continue;
+        out->drops += values[cpu].drops;
+        if (values[cpu].last_seen > out->last_seen)
+            out->last_seen = values[cpu].last_seen;
+    }
+    out->key = key;
+    out->pad = 0;
+}
+
+#endif
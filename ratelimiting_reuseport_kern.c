@@ -0,0 +1,116 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Spread the admitted connections over the listening sockets of the
+ * workers of a service. Each worker has a share of the budget the limiter
+ * admits, a SYN goes to the worker picked by the reuseport hash or, when
+ * that one has used its share, to one of the next workers. The SYNs were
+ * already admitted, none is refused here. */
+
+#define KBUILD_MODNAME "foo"
+
+#include <uapi/linux/bpf.h>
+#include <uapi/linux/in.h>
+#include <uapi/linux/tcp.h>
+
+#include "bpf_helpers.h"
+
+#include "ratelimiting_common.h"
+#include "ratelimiting_window.h"
+
+/* Configuration of the limiter, replaced by the map of the XDP program
+ * when the daemon loads both */
+struct bpf_map_def SEC("maps") rl_config_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint64_t),
+	.max_entries	= RL_CONFIG_MAX,
+};
+
+/* Listening socket of each worker, added by the workers themselves */
+struct bpf_map_def SEC("maps") rl_reuseport_socks_map = {
+	.type		= BPF_MAP_TYPE_REUSEPORT_SOCKARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(uint32_t),
+	.max_entries	= RL_MAX_WORKERS,
+};
+
+/* Window and counters of each worker */
+struct bpf_map_def SEC("maps") rl_worker_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(uint32_t),
+	.value_size	= sizeof(struct rl_worker_state),
+	.max_entries	= RL_MAX_WORKERS,
+};
+
+static __always_inline uint64_t rl_config(uint32_t idx)
+{
+    uint64_t *val = bpf_map_lookup_elem(&rl_config_map, &idx);
+
+    return val ? *val : 0;
+}
+
+SEC("sk_reuseport")
+int _reuseport_ratelimiting(struct sk_reuseport_md *md)
+{
+    void *data_end = (void *)(long)md->data_end;
+    void *data = (void *)(long)md->data;
+    struct tcphdr *tcph = data;
+    struct rl_worker_state *worker;
+    uint64_t workers, share, tnow;
+    uint32_t first, idx;
+    int i, selected = 0;
+
+    /* The packet starts at the TCP header, only the SYNs are spread, the
+     * rest keeps the choice of the kernel */
+    if (md->ip_protocol != IPPROTO_TCP || tcph + 1 > data_end ||
+        !tcph->syn || tcph->ack)
+        return SK_PASS;
+
+    workers = rl_config(RL_CONFIG_WORKERS);
+    if (!workers || workers > RL_MAX_WORKERS)
+        return SK_PASS;
+    /* The global window admits the rate, the priority headroom above it
+     * and the premium window besides it */
+    share = (rl_config(RL_CONFIG_RATE) +
+             rl_config(RL_CONFIG_PRIORITY_HEADROOM) +
+             rl_config(RL_CONFIG_PREMIUM_RATE)) / workers;
+    if (!share)
+        return SK_PASS;
+
+    tnow = bpf_ktime_get_ns();
+    first = md->hash % workers;
+#pragma unroll
+    for (i = 0; i < RL_REUSEPORT_PROBES; i++) {
+        if (i >= workers)
+            break;
+        idx = first + i;
+        if (idx >= workers)
+            idx -= workers;
+        worker = bpf_map_lookup_elem(&rl_worker_map, &idx);
+        if (!worker)
+            return SK_PASS;
+        /* A worker without a socket yet is skipped */
+        if (bpf_sk_select_reuseport(md, &rl_reuseport_socks_map, &idx, 0))
+            continue;
+        selected = 1;
+        if (rl_window_admit(&worker->window, tnow, share, 1) == XDP_PASS) {
+            __sync_fetch_and_add(&worker->syns, 1);
+            return SK_PASS;
+        }
+    }
+    /* None of the workers probed has a socket, the kernel picks one */
+    if (!selected)
+        return SK_PASS;
+
+    /* The workers probed have all used their share, the SYN goes to the
+     * worker of its hash as the kernel would pick it */
+    idx = first;
+    worker = bpf_map_lookup_elem(&rl_worker_map, &idx);
+    if (worker)
+        __sync_fetch_and_add(&worker->overflows, 1);
+    bpf_sk_select_reuseport(md, &rl_reuseport_socks_map, &idx, 0);
+    return SK_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,69 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Record the SYN-ACKs of the servers for the handshakes tracked by the XDP
+ * program. Attached to the egress of the interface, it stores the initial
+ * sequence number of the server in the flow of the SYN, so the final ACK
+ * is only taken as the end of the handshake when it acknowledges it. The
+ * client picks its own ISN, the one of the server is what a spoofed source
+ * never sees. */
+
+#define KBUILD_MODNAME "foo"
+
+#include <uapi/linux/bpf.h>
+#include <uapi/linux/if_ether.h>
+#include <uapi/linux/ip.h>
+#include <uapi/linux/in.h>
+#include <uapi/linux/tcp.h>
+#include <uapi/linux/pkt_cls.h>
+
+#include "bpf_helpers.h"
+#include "bpf_endian.h"
+
+#include "ratelimiting_common.h"
+
+/* Admitted SYNs waiting for the final ACK, replaced by the map of the XDP
+ * program when the daemon loads both */
+struct bpf_map_def SEC("maps") rl_syn_flow_map = {
+	.type		= BPF_MAP_TYPE_LRU_HASH,
+	.key_size	= sizeof(struct rl_flow_key),
+	.value_size	= sizeof(struct rl_flow_state),
+	.max_entries	= RL_FLOW_ENTRIES,
+};
+
+SEC("classifier")
+int _tc_synack(struct __sk_buff *skb)
+{
+    void *data_end = (void *)(long)skb->data_end;
+    void *data = (void *)(long)skb->data;
+    struct ethhdr *eth = data;
+    struct rl_flow_state *flow;
+    struct tcphdr *tcph;
+    struct iphdr *iph;
+
+    if (eth + 1 > data_end || eth->h_proto != bpf_htons(ETH_P_IP))
+        return TC_ACT_OK;
+    iph = (struct iphdr *)(eth + 1);
+    if (iph + 1 > data_end || iph->protocol != IPPROTO_TCP)
+        return TC_ACT_OK;
+    tcph = (struct tcphdr *)(iph + 1);
+    if (tcph + 1 > data_end || !tcph->syn || !tcph->ack)
+        return TC_ACT_OK;
+
+    /* The flow is keyed from the client */
+    struct rl_flow_key fkey = {
+        .saddr = iph->daddr,
+        .daddr = iph->saddr,
+        .sport = tcph->dest,
+        .dport = tcph->source,
+    };
+    flow = bpf_map_lookup_elem(&rl_syn_flow_map, &fkey);
+    if (!flow || bpf_ntohl(tcph->ack_seq) != flow->isn + 1)
+        return TC_ACT_OK;
+
+    flow->srv_isn = bpf_ntohl(tcph->seq);
+    flow->synack = 1;
+    return TC_ACT_OK;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -3,6 +3,8 @@
 
 /* Ratelimit incoming TCP connections with sliding window approach */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <linux/bpf.h>
 #include <signal.h>
@@ -12,10 +14,23 @@
 #include <sys/time.h>
 #include <getopt.h>
 #include <net/if.h>
+#include <arpa/inet.h>
 #include <time.h>
 #include <string.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
 
 #include "bpf_load.h"
 #include "bpf_util.h"
@@ -23,14 +38,77 @@
 
 #include "constants.h"
 #include "log.h"
+#include "ratelimiting_common.h"
+#include "ratelimiting_reduce.h"
 
 static const char *__doc__ =
         "Ratelimit incoming TCP connections using XDP";
 
-static int ifindex;
+static __u32 max_keys = RL_MAX_KEYS_DEFAULT;
+
+/* The program loaded and chained for one interface. With the state shared
+ * every instance uses the maps of the first one, except its next program
+ * map, so they all draw from one host-wide budget. */
+struct rl_instance {
+    char ifname[IF_NAMESIZE];
+    char prev_prog_map[1024];
+    char next_prog_map[PATH_MAX];
+    char pin_dir[PATH_MAX];
+    int map_fd[MAP_COUNT];
+    int prog_fd;
+    int nr_queues;
+    /* Counters of the RX queues and the CPUs at the last queue stats */
+    struct rl_queue_stats prev_queues[RL_MAX_QUEUES];
+    struct rl_queue_stats *prev_cpus;
+    /* SYN-ACK program at the egress of the interface */
+    struct bpf_object *synack_obj;
+    int ifindex;
+};
+
+static struct rl_instance instances[MAX_INSTANCES];
+static int nr_instances, nr_prev_prog_maps, nr_loaded;
+static int shared_state;
+
+/* A cgroup whose passive opens are limited by the cgroup program */
+struct rl_cgroup {
+    char path[PATH_MAX];
+    __u64 limit;
+    __u64 id;
+    int fd;
+};
+
+static struct rl_cgroup cgroups[MAX_CGROUPS];
+static int nr_cgroups, nr_attached;
+static int cgroup_prog_fd, cgroup_map_fd[CGROUP_MAP_COUNT];
+
+/* Reuseport program spreading the SYNs over the workers of a service */
+static int nr_workers;
+static struct bpf_object *reuseport_obj;
+static int reuseport_prog_fd, reuseport_map_fd[REUSEPORT_MAP_COUNT];
+
+/* Maps of the reuseport program, see enum rl_reuseport_map_idx */
+static const char *reuseport_maps[REUSEPORT_MAP_COUNT] = {
+    "rl_config_map",
+    "rl_reuseport_socks_map",
+    "rl_worker_map",
+};
+
+/* Maps pinned in the directory of every instance, for --dump and the tools
+ * reading its configuration and counters */
+static const struct {
+    int idx;
+    const char *name;
+} pinned_maps[] = {
+    { RL_CONFIG_MAP,      "rl_config_map" },
+    { RL_RECV_COUNT_MAP,  "rl_recv_count_map" },
+    { RL_DROP_COUNT_MAP,  "rl_drop_count_map" },
+    { RL_PROTO_STATS_MAP, "rl_proto_stats_map" },
+    { RL_FP_MAP,          "rl_fp_map" },
+    { RL_HOT_MAP,         "rl_hot_map" },
+    { RL_XSK_MAP,         "rl_xsk_map" },
+};
 
 FILE *info;
-static char prev_prog_map[1024];
 static const struct option long_options[] = {
     {"help",      no_argument,        NULL, 'h' },
     {"iface",     required_argument,  NULL, 'i' },
@@ -39,6 +117,51 @@ static const struct option long_options[] = {
     {"verbose",   optional_argument,  NULL, 'v' },
     {"direction", optional_argument,  NULL, 'd'},
     {"map-name",  optional_argument,  NULL, 'm' },
+    {"mode",      required_argument,  NULL, 'M' },
+    {"burst",     required_argument,  NULL, 'b' },
+    {"prefix-len", required_argument, NULL, 'l' },
+    {"max-keys",  required_argument,  NULL, 'k' },
+    {"half-life", required_argument,  NULL, 'H' },
+    {"source-rate", required_argument, NULL, 's' },
+    {"priority-headroom", required_argument, NULL, 'P' },
+    {"retrans",   no_argument,        NULL, 'R' },
+    {"reputation", no_argument,       NULL, 'g' },
+    {"reputation-ttl", required_argument, NULL, 'G' },
+    {"max-half-open", required_argument, NULL, 'o' },
+    {"half-open-timeout", required_argument, NULL, 'O' },
+    {"max-concurrent", required_argument, NULL, 'c' },
+    {"conn-idle-timeout", required_argument, NULL, 'C' },
+    {"action",    required_argument,  NULL, 'a' },
+    {"rst-rate",  required_argument,  NULL, 'T' },
+    {"mark-dscp", required_argument,  NULL, 'D' },
+    {"mark-flow", no_argument,        NULL, 'F' },
+    {"premium-rate", required_argument, NULL, 'x' },
+    {"premium-dscp", required_argument, NULL, 'X' },
+    {"redirect-dev", required_argument, NULL, 'e' },
+    {"redirect-cpus", required_argument, NULL, 'u' },
+    {"quic-ports", required_argument, NULL, 'q' },
+    {"class",     required_argument,  NULL, 'w' },
+    {"fingerprint", no_argument,      NULL, 'n' },
+    {"fp-rate",   required_argument,  NULL, 'f' },
+    {"fp-limit",  required_argument,  NULL, 'L' },
+    {"fp-top",    required_argument,  NULL, 't' },
+    {"decap",     no_argument,        NULL, 'E' },
+    {"gue-port",  required_argument,  NULL, 'U' },
+    {"vxlan-port", required_argument, NULL, 'V' },
+    {"queue-stats", no_argument,      NULL, 'Q' },
+    {"state",     required_argument,  NULL, 'S' },
+    {"sync-bind", required_argument,  NULL, 'B' },
+    {"sync-peers", required_argument, NULL, 'N' },
+    {"sync-interval", required_argument, NULL, 'I' },
+    {"sync-timeout", required_argument, NULL, 'W' },
+    {"ramp",      required_argument,  NULL, 'A' },
+    {"ramp-floor", required_argument, NULL, 'y' },
+    {"hot-keys",  no_argument,        NULL, 'K' },
+    {"dump",      no_argument,        NULL, 'Z' },
+    {"dump-top",  required_argument,  NULL, 'Y' },
+    {"dump-min",  required_argument,  NULL, 'z' },
+    {"cgroup",    required_argument,  NULL, 'j' },
+    {"reuseport-workers", required_argument, NULL, 'J' },
     {0,           0,                  NULL,  0  }
 };
 
@@ -109,7 +232,8 @@ static FILE* set_logfile(void)
 }
 
 // This method to unlink the program
-static int xdp_unlink_bpf_chain(const char *map_filename) {
+static int xdp_unlink_bpf_chain(const char *map_filename,
+                                const char *next_prog_map) {
     int ret = 0;
     int key = 0;
     int map_fd = bpf_obj_get(map_filename);
@@ -123,7 +247,7 @@ static int xdp_unlink_bpf_chain(const char *map_filename) {
        log_err("Failed to fetch previous XDP program in the chain");
     }
 
-    if (remove(xdp_rl_ingress_next_prog) < 0) {
+    if (remove(next_prog_map) < 0) {
         log_warn("Failed to remove link to next XDP program in the chain");
     }
 
@@ -131,20 +255,6 @@ static int xdp_unlink_bpf_chain(const char *map_filename) {
 }
 
 
-/* Unlink xdp kernel program on receiving KILL/INT signals */
-static void signal_handler(int signal)
-{
-    log_info("Received signal %d", signal);
-    int i = 0;
-    xdp_unlink_bpf_chain(prev_prog_map);
-    for(i=0; i<MAP_COUNT;i++) {
-       close(map_fd[i]);
-    }
-    if (info != NULL)
-        fclose(info);
-    exit(EXIT_SUCCESS);
-}
-
 /* Get monotonic clock time in ns */
 static __u64 time_get_ns(void)
 {
@@ -160,7 +270,7 @@ static void delete_stale_entries(void)
 {
     log_debug("Deleting stale map entries periodically");
 
-    if (map_fd[1] < 0) {
+    if (map_fd[RL_WINDOW_MAP] < 0) {
         log_info("Window map fd not found");
         exit(EXIT_FAILURE);
     }
@@ -169,11 +279,11 @@ static void delete_stale_entries(void)
     __u64 curr_time = time_get_ns();
     log_debug("Current time is %llu", curr_time);
 
-    while (!bpf_map_get_next_key(map_fd[1], &first_key, &next_key))
+    while (!bpf_map_get_next_key(map_fd[RL_WINDOW_MAP], &first_key, &next_key))
     {
-        if (next_key < (curr_time - buffer_time)) {
+        if (next_key < (curr_time - buffer_time * RL_NANO)) {
             log_debug("Deleting stale map entry %llu", next_key);
-            if (bpf_map_delete_elem(map_fd[1], &next_key) != 0) {
+            if (bpf_map_delete_elem(map_fd[RL_WINDOW_MAP], &next_key) != 0) {
                 log_info("Map element not found");
             }
         }
@@ -181,6 +291,113 @@ static void delete_stale_entries(void)
     }
 }
 
+/* Number of established connections of a service, in an open addressing
+ * table keyed by the service */
+struct vip_conns {
+    struct rl_vip_key key;
+    __u64 conns;
+    __u8 used;
+    __u8 written;
+};
+
+#define VIP_HASH_SIZE   (2 * RL_VIP_ENTRIES)
+
+static struct vip_conns *find_vip_conn(struct vip_conns *vips, __u32 daddr,
+                                       __u16 dport)
+{
+    __u32 h = (daddr ^ ((__u32)dport << 16)) * 2654435761u;
+    __u32 i, slot;
+
+    for (i = 0; i < VIP_HASH_SIZE; i++) {
+        slot = (h + i) & (VIP_HASH_SIZE - 1);
+        if (!vips[slot].used ||
+            (vips[slot].key.daddr == daddr && vips[slot].key.dport == dport))
+            return &vips[slot];
+    }
+    return NULL;
+}
+
+static void count_vip_conn(struct vip_conns *vips, int *nr_vips,
+                           const struct rl_flow_key *flow)
+{
+    struct vip_conns *vip = find_vip_conn(vips, flow->daddr, flow->dport);
+
+    if (!vip)
+        return;
+    if (!vip->used) {
+        if (*nr_vips == RL_VIP_ENTRIES)
+            return;
+        vip->used = 1;
+        vip->key.daddr = flow->daddr;
+        vip->key.dport = flow->dport;
+        (*nr_vips)++;
+    }
+    vip->conns++;
+}
+
+/* Expire the established connections idle for longer than idle_timeout,
+ * their FIN or RST was missed or they were evicted, and recount the
+ * connections per service from the ones left. */
+static void sweep_connections(__u64 idle_timeout)
+{
+    struct rl_flow_key key, next_key;
+    struct rl_vip_key vkey, next_vkey;
+    static struct vip_conns vips[VIP_HASH_SIZE];
+    struct vip_conns *vip;
+    int nr_vips = 0, has_key = 0, stale = 0, expired = 0, i;
+    __u64 seen, zero = 0;
+    __u64 curr_time = time_get_ns();
+
+    memset(vips, 0, sizeof(vips));
+    while (!bpf_map_get_next_key(map_fd[RL_CONN_MAP], has_key ? &key : NULL,
+                                 &next_key))
+    {
+        /* Delete the previous key only once the next one is known, so the
+         * walk does not restart from the beginning */
+        if (stale && !bpf_map_delete_elem(map_fd[RL_CONN_MAP], &key))
+            expired++;
+        key = next_key;
+        has_key = 1;
+        stale = bpf_map_lookup_elem(map_fd[RL_CONN_MAP], &key, &seen) ||
+            (seen < curr_time && curr_time - seen > idle_timeout);
+        if (!stale)
+            count_vip_conn(vips, &nr_vips, &key);
+    }
+    if (stale && !bpf_map_delete_elem(map_fd[RL_CONN_MAP], &key))
+        expired++;
+
+    /* The recount is written over the services in place, services without
+     * connections left get 0. Resetting them all first would lose the
+     * connections counted by the XDP program in between. */
+    has_key = 0;
+    while (!bpf_map_get_next_key(map_fd[RL_VIP_CONN_MAP],
+                                 has_key ? &vkey : NULL, &next_vkey))
+    {
+        vkey = next_vkey;
+        has_key = 1;
+        vip = find_vip_conn(vips, vkey.daddr, vkey.dport);
+        if (vip && vip->used) {
+            vip->written = 1;
+            bpf_map_update_elem(map_fd[RL_VIP_CONN_MAP], &vkey, &vip->conns,
+                                BPF_EXIST);
+        } else {
+            bpf_map_update_elem(map_fd[RL_VIP_CONN_MAP], &vkey, &zero,
+                                BPF_EXIST);
+        }
+    }
+    for (i = 0; i < VIP_HASH_SIZE; i++) {
+        if (!vips[i].used)
+            continue;
+        if (!vips[i].written)
+            bpf_map_update_elem(map_fd[RL_VIP_CONN_MAP], &vips[i].key,
+                                &vips[i].conns, BPF_NOEXIST);
+        log_debug("Service %s:%u has %llu connections",
+                  inet_ntoa(*(struct in_addr *)&vips[i].key.daddr),
+                  ntohs(vips[i].key.dport), vips[i].conns);
+    }
+    log_debug("Expired %d idle connections", expired);
+}
+
 static char* trim_space(char *str) {
     char *end;
     /* skip leading whitespace */
@@ -210,164 +427,2146 @@ static int strtoi(const char *str) {
   return (int) long_var;
 }
 
-static void update_ports(char *ports)
+static int parse_action(const char *action)
 {
-    char *ptr,*tmp ;
+    if (strcmp(action, "drop") == 0)
+        return RL_ACTION_DROP;
+    if (strcmp(action, "rst") == 0)
+        return RL_ACTION_RST;
+    if (strcmp(action, "mark") == 0)
+        return RL_ACTION_MARK;
+    if (strcmp(action, "redirect") == 0)
+        return RL_ACTION_REDIRECT;
+    if (strcmp(action, "xsk") == 0)
+        return RL_ACTION_XSK;
+
+    fprintf(stderr, "unknown action %s", action);
+    return -1;
+}
+
+/* Ports are given as port[:action], the default action is used for the
+ * ports without one. ports_map is either the TCP or the QUIC ports map. */
+static void update_ports(char *ports, int default_action, int ports_map)
+{
+    char *ptr, *tmp, *port_action;
     uint16_t port = 0;
-    uint8_t pval = 1;
+    uint8_t pval;
+    int action;
+    struct rl_port_stats stats;
+    memset(&stats, 0, sizeof(stats));
     tmp = strdup(ports);
     while((ptr = strsep(&tmp, delim)) != NULL)
+    {
+        port_action = trim_space(ptr);
+        ptr = strsep(&port_action, action_delim);
+        port = (uint16_t)(strtoi(trim_space(ptr)));
+        action = port_action ? parse_action(trim_space(port_action)) :
+            default_action;
+        if (action < 0) {
+            log_err("Invalid action for port %u", port);
+            continue;
+        }
+        pval = (uint8_t)action;
+        bpf_map_update_elem(map_fd[ports_map], &port, &pval, 0);
+        if (ports_map == RL_PORTS_MAP)
+            bpf_map_update_elem(map_fd[RL_PORT_STATS_MAP], &port, &stats, 0);
+    }
+    free(tmp);
+}
+
+/* QUIC has no RST and the AF_XDP engine only takes the TCP SYNs, returns
+ * -1 when a QUIC port gets the rst or the xsk action, given or by default */
+static int check_quic_actions(const char *ports, int default_action)
+{
+    char *ptr, *tmp, *copy, *port_action;
+    int action, ret = 0;
+
+    copy = tmp = strdup(ports);
+    if (!copy)
+        return -1;
+    while ((ptr = strsep(&tmp, delim)) != NULL)
+    {
+        port_action = trim_space(ptr);
+        strsep(&port_action, action_delim);
+        action = port_action ? parse_action(trim_space(port_action)) :
+            default_action;
+        if (action == RL_ACTION_RST || action == RL_ACTION_XSK)
+            ret = -1;
+    }
+    free(copy);
+    return ret;
+}
+
+/* DSCP values given are put in the premium admission class */
+static void update_premium_dscp(char *dscps)
+{
+    char *ptr, *tmp;
+    __u32 dscp;
+    __u8 dscp_class = RL_CLASS_PREMIUM;
+    tmp = strdup(dscps);
+    while((ptr = strsep(&tmp, delim)) != NULL)
     {
         ptr = trim_space(ptr);
-        port = (uint16_t)(strtoi(ptr));
-        bpf_map_update_elem(map_fd[4], &port, &pval, 0);
+        dscp = (__u32)strtoi(ptr);
+        if (dscp > 63) {
+            log_err("Invalid DSCP %u", dscp);
+            continue;
+        }
+        bpf_map_update_elem(map_fd[RL_DSCP_CLASS_MAP], &dscp, &dscp_class, 0);
     }
     free(tmp);
 }
 
-int main(int argc, char **argv)
+/* Set up the targets of the redirect action, the CPU set takes precedence
+ * over the device. Returns the number of CPUs in the CPU set. */
+static int update_redirect(int redirect_ifindex, char *cpus)
 {
-    int longindex = 0, rate = 0, opt;
-    int ret = EXIT_SUCCESS;
-    char bpf_obj_file[256];
-    char ports[2048];
-    verbosity = LOG_INFO;
-    struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
-    int len = 0;
-    snprintf(bpf_obj_file, sizeof(bpf_obj_file), "%s_kern.o", argv[0]);
+    char *ptr, *tmp;
+    __u32 key = 0, cpu, qsize = REDIRECT_CPU_QSIZE;
+    int nr_cpus = 0;
 
-    memset(&ports, 0, 2048);
+    if (redirect_ifindex &&
+        bpf_map_update_elem(map_fd[RL_REDIRECT_DEV_MAP], &key,
+                            &redirect_ifindex, 0))
+        log_err("Failed to set the redirect device");
 
-    /* Parse commands line args */
-    while ((opt = getopt_long(argc, argv, "h", long_options, &longindex)) != -1)
+    tmp = strdup(cpus);
+    while((ptr = strsep(&tmp, delim)) != NULL)
     {
-        switch (opt) {
-            case 'r':
-                rate = strtoi(optarg);
-                break;
-            case 'i':
-                ifindex = if_nametoindex(optarg);
-                break;
-            case 'v':
-                if(optarg) {
-                    verbosity = strtoi(optarg);
-                }
-                break;
-            case 'm':
-                if(optarg) {
-                    len = get_length(optarg);
-                    strncpy(prev_prog_map, optarg, len);
-                    prev_prog_map[len] = '\0';
-                }
-                break;
-            case 'p':
-                if(optarg) {
-                    len = get_length(optarg);
-                    strncpy(ports, optarg, len);
-                    ports[len] = '\0';
-                }
-                break;
-            case 'd':
-                /* Not honoured as of now */
-                break;
-            case 'h':
-            default:
-                usage(argv);
-                return EXIT_FAILURE;
+        ptr = trim_space(ptr);
+        if (!get_length(ptr))
+            continue;
+        cpu = (__u32)strtoi(ptr);
+        if (nr_cpus == RL_REDIRECT_CPUS ||
+            bpf_map_update_elem(map_fd[RL_REDIRECT_CPU_MAP], &cpu, &qsize, 0)) {
+            log_err("Failed to add CPU %u to the redirect CPU set", cpu);
+            continue;
         }
+        key = nr_cpus++;
+        bpf_map_update_elem(map_fd[RL_REDIRECT_CPUS_MAP], &key, &cpu, 0);
     }
-    if (setrlimit(RLIMIT_MEMLOCK, &r)) {
-        perror("setrlimit(RLIMIT_MEMLOCK)");
-        exit(EXIT_FAILURE);
+    free(tmp);
+    return nr_cpus;
+}
+
+static int parse_proto(const char *proto)
+{
+    if (strcmp(proto, "tcp") == 0)
+        return IPPROTO_TCP;
+    if (strcmp(proto, "udp") == 0)
+        return IPPROTO_UDP;
+    if (strcmp(proto, "icmp") == 0)
+        return IPPROTO_ICMP;
+    return strtoi(proto);
+}
+
+/* Traffic classes are given as proto:src|dst:port:pps|bps:limit, port 0
+ * matches any port. The windows of the classes are per CPU, each CPU
+ * admits its share of the limit. Returns the number of traffic classes
+ * configured. */
+static int update_classes(char *classes)
+{
+    char *ptr, *tmp, *fields[5];
+    struct rl_class_key ckey;
+    struct rl_class_policy policy;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nr_classes = 0, i;
+
+    if (nr_cpus < 1)
+        nr_cpus = 1;
+    tmp = strdup(classes);
+    while((ptr = strsep(&tmp, delim)) != NULL)
+    {
+        ptr = trim_space(ptr);
+        if (!get_length(ptr))
+            continue;
+        for (i = 0; i < 5; i++)
+            fields[i] = strsep(&ptr, action_delim);
+        if (!fields[4] || nr_classes == RL_MAX_CLASSES) {
+            log_err("Invalid traffic class %s", fields[0]);
+            continue;
+        }
+
+        memset(&ckey, 0, sizeof(ckey));
+        memset(&policy, 0, sizeof(policy));
+        ckey.proto = (__u8)parse_proto(fields[0]);
+        if (strcmp(fields[1], "src") == 0)
+            ckey.match = RL_MATCH_SRC;
+        else if (strcmp(fields[1], "dst") == 0)
+            ckey.match = RL_MATCH_DST;
+        else {
+            log_err("Invalid match %s of traffic class, src or dst",
+                    fields[1]);
+            continue;
+        }
+        ckey.port = (__u16)strtoi(fields[2]);
+        if (strcmp(fields[3], "bps") == 0)
+            policy.unit = RL_UNIT_BYTES;
+        else if (strcmp(fields[3], "pps") == 0)
+            policy.unit = RL_UNIT_PKTS;
+        else {
+            log_err("Invalid unit %s of traffic class, pps or bps",
+                    fields[3]);
+            continue;
+        }
+        policy.limit = (__u64)strtoll(fields[4], NULL, 10) / nr_cpus;
+        if (!policy.limit)
+            policy.limit = 1;
+        policy.id = nr_classes;
+        if (bpf_map_update_elem(map_fd[RL_CLASS_POLICY_MAP], &ckey, &policy,
+                                0)) {
+            log_err("Failed to add traffic class %u", policy.id);
+            continue;
+        }
+        nr_classes++;
     }
-    set_logfile();
+    free(tmp);
+    return nr_classes;
+}
 
-    __u64 ckey = 0, rkey = 0, dkey = 0, pkey = 0;
-    __u64 recv_count = 0, drop_count = 0;
+/* Log the traffic seen and dropped per traffic class, summed over the
+ * CPUs */
+static void log_class_stats(void)
+{
+    struct rl_class_key ckey, next_ckey;
+    struct rl_class_policy policy;
+    struct rl_class_stats stats, *values;
+    unsigned int nr_cpus = bpf_num_possible_cpus(), cpu;
+    int has_key = 0;
 
-    if (load_bpf_file(bpf_obj_file)) {
-        log_err("Failed to load bpf program");
-        return 1;
+    values = calloc(nr_cpus, sizeof(*values));
+    if (!values)
+        return;
+    while (!bpf_map_get_next_key(map_fd[RL_CLASS_POLICY_MAP],
+                                 has_key ? &ckey : NULL, &next_ckey))
+    {
+        ckey = next_ckey;
+        has_key = 1;
+        if (bpf_map_lookup_elem(map_fd[RL_CLASS_POLICY_MAP], &ckey, &policy) ||
+            bpf_map_lookup_elem(map_fd[RL_CLASS_STATS_MAP], &policy.id,
+                                values))
+            continue;
+        memset(&stats, 0, sizeof(stats));
+        for (cpu = 0; cpu < nr_cpus; cpu++) {
+            stats.pkts += values[cpu].pkts;
+            stats.bytes += values[cpu].bytes;
+            stats.drop_pkts += values[cpu].drop_pkts;
+            stats.drop_bytes += values[cpu].drop_bytes;
+        }
+        log_info("Class %u(proto %u %s port %u): packets %llu bytes %llu "
+                 "dropped packets %llu dropped bytes %llu", policy.id,
+                 ckey.proto, ckey.match == RL_MATCH_SRC ? "src" : "dst",
+                 ckey.port, stats.pkts, stats.bytes, stats.drop_pkts,
+                 stats.drop_bytes);
     }
-    if (!prog_fd[0]) {
-        log_err("Failed to get bpf program fd")
-        return 1;
+    free(values);
+}
+
+/* Fingerprints are written ttl:window:mss:wscale:kind-kind-..., in the
+ * order of the options of the SYN. wscale 255 stands for no window scale
+ * option. */
+static void format_fp(const struct rl_fp *fp, char *buf, size_t size)
+{
+    int len, i;
+
+    len = snprintf(buf, size, "%u:%u:%u:%u:", fp->ttl, fp->window, fp->mss,
+                   fp->wscale);
+    for (i = 0; i < fp->nr_options && i < RL_TCP_MAX_OPTIONS &&
+         len < (int)size; i++)
+        len += snprintf(buf + len, size - len, "%s%u", i ? fp_opt_delim : "",
+                        fp->options[i]);
+}
+
+static int parse_fp(char *str, struct rl_fp *fp)
+{
+    char *fields[5], *kind;
+    int i, k;
+
+    for (i = 0; i < 5; i++)
+        fields[i] = strsep(&str, action_delim);
+    if (!fields[4])
+        return -1;
+
+    memset(fp, 0, sizeof(*fp));
+    fp->ttl = (__u8)strtoi(fields[0]);
+    fp->window = (__u16)strtoi(fields[1]);
+    fp->mss = (__u16)strtoi(fields[2]);
+    fp->wscale = (__u8)strtoi(fields[3]);
+    while ((kind = strsep(&fields[4], fp_opt_delim)) != NULL) {
+        if (!get_length(kind))
+            continue;
+        k = strtoi(kind);
+        if (k < 0 || k > 255 || fp->nr_options == RL_TCP_MAX_OPTIONS)
+            return -1;
+        fp->options[fp->nr_options++] = (__u8)k;
     }
+    return 0;
+}
 
-    /* Get the previous program's map fd in the chain */
-    int prev_prog_map_fd = bpf_obj_get(prev_prog_map);
-    if (prev_prog_map_fd < 0) {
-        log_err("Failed to fetch previous xdp function in the chain");
-        exit(EXIT_FAILURE);
+/* Fingerprint limits are given as fingerprint=rate, see format_fp */
+static void update_fp_limits(char *limits)
+{
+    char *ptr, *tmp, *fp_str;
+    struct rl_fp fp;
+    __u64 rate;
+
+    tmp = strdup(limits);
+    while((ptr = strsep(&tmp, delim)) != NULL)
+    {
+        ptr = trim_space(ptr);
+        if (!get_length(ptr))
+            continue;
+        fp_str = strsep(&ptr, "=");
+        if (!ptr || parse_fp(fp_str, &fp)) {
+            log_err("Invalid fingerprint limit %s", fp_str);
+            continue;
+        }
+        rate = (__u64)strtoll(ptr, NULL, 10);
+        if (bpf_map_update_elem(map_fd[RL_FP_LIMIT_MAP], &fp, &rate, 0))
+            log_err("Failed to add the fingerprint limit %s", fp_str);
     }
-    /* Update current prog fd in the last prog map fd,
-     * so it can chain the current one */
-    if(bpf_map_update_elem(prev_prog_map_fd, &pkey, &(prog_fd[0]), 0)) {
-        log_err("Failed to update prog fd in the chain");
-        exit(EXIT_FAILURE);
+    free(tmp);
+}
+
+/* Log the fingerprints sending the most SYNs, in the format taken by
+ * --fp-limit */
+static void log_top_fingerprints(int top)
+{
+    struct rl_fp fp, next_fp, *top_fp;
+    struct rl_fp_state state, *top_state;
+    char buf[128];
+    int has_key = 0, nr_top = 0, i;
+
+    top_fp = calloc(top, sizeof(*top_fp));
+    top_state = calloc(top, sizeof(*top_state));
+    if (!top_fp || !top_state)
+        goto out;
+
+    while (!bpf_map_get_next_key(map_fd[RL_FP_MAP], has_key ? &fp : NULL,
+                                 &next_fp))
+    {
+        fp = next_fp;
+        has_key = 1;
+        if (bpf_map_lookup_elem(map_fd[RL_FP_MAP], &fp, &state))
+            continue;
+        if (nr_top == top && state.syns <= top_state[top - 1].syns)
+            continue;
+
+        /* Insertion into the list sorted by SYNs */
+        i = nr_top < top ? nr_top++ : top - 1;
+        for (; i > 0 && top_state[i - 1].syns < state.syns; i--) {
+            top_fp[i] = top_fp[i - 1];
+            top_state[i] = top_state[i - 1];
+        }
+        top_fp[i] = fp;
+        top_state[i] = state;
     }
-     /* closing map fd to avoid stale map */
-     close(prev_prog_map_fd);
 
-    int next_prog_map_fd = bpf_obj_get(xdp_rl_ingress_next_prog);
-    if (next_prog_map_fd < 0) {
-        log_info("Failed to fetch next prog map fd, creating one");
-        if (bpf_obj_pin(map_fd[5], xdp_rl_ingress_next_prog)) {
-            log_info("Failed to pin next prog fd map");
-            exit(EXIT_FAILURE);
+    for (i = 0; i < nr_top; i++) {
+        format_fp(&top_fp[i], buf, sizeof(buf));
+        log_info("Fingerprint %s: syns %llu dropped %llu", buf,
+                 top_state[i].syns, top_state[i].drops);
+    }
+out:
+    free(top_fp);
+    free(top_state);
+}
+
+/* Number of RX queues of the interface, 0 when unknown */
+static int count_rx_queues(const char *ifname)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    int nr_queues = 0;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    dir = opendir(path);
+    if (!dir)
+        return 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "rx-", 3) == 0)
+            nr_queues++;
+    }
+    closedir(dir);
+    return nr_queues;
+}
+
+static void add_queue_stats(struct rl_queue_stats *to,
+                            const struct rl_queue_stats *from, int sign)
+{
+    to->syns += sign * from->syns;
+    to->drops += sign * from->drops;
+    to->ns += sign * from->ns;
+}
+
+/* Log the SYNs received and dropped per RX queue of the instance since its
+ * last call and how unevenly they spread over the queues and the CPUs. The
+ * skew is the busiest queue(CPU) over the mean, 1 when RSS spreads the SYNs
+ * evenly. A high skew points at RSS, an even spread with a high cost per
+ * SYN points at the limiter. */
+static void log_queue_stats(struct rl_instance *inst)
+{
+    struct rl_queue_stats *prev_queues = inst->prev_queues, *prev_cpus;
+    unsigned int nr_cpus = bpf_num_possible_cpus(), cpu;
+    struct rl_queue_stats *values, *cpus, sum, total;
+    __u64 max_queue_syns = 0, max_cpu_syns = 0;
+    __u32 queue, max_queue = 0, max_cpu = 0;
+    int active_queues = 0, active_cpus = 0;
+    int online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nr_queues = inst->nr_queues;
+
+    if (!inst->prev_cpus)
+        inst->prev_cpus = calloc(nr_cpus, sizeof(*inst->prev_cpus));
+    prev_cpus = inst->prev_cpus;
+    values = calloc(nr_cpus, sizeof(*values));
+    cpus = calloc(nr_cpus, sizeof(*cpus));
+    if (!prev_cpus || !values || !cpus)
+        goto out;
+
+    memset(&total, 0, sizeof(total));
+    for (queue = 0; queue < RL_MAX_QUEUES; queue++) {
+        if (bpf_map_lookup_elem(map_fd[RL_QUEUE_STATS_MAP], &queue, values))
+            continue;
+        memset(&sum, 0, sizeof(sum));
+        for (cpu = 0; cpu < nr_cpus; cpu++) {
+            add_queue_stats(&sum, &values[cpu], 1);
+            add_queue_stats(&cpus[cpu], &values[cpu], 1);
+        }
+        add_queue_stats(&sum, &prev_queues[queue], -1);
+        add_queue_stats(&prev_queues[queue], &sum, 1);
+        if (!sum.syns)
+            continue;
+
+        log_info("RX queue %u: syns %llu dropped %llu cost %.0f ns per SYN",
+                 queue, sum.syns, sum.drops, (double)sum.ns / sum.syns);
+        add_queue_stats(&total, &sum, 1);
+        active_queues++;
+        if (sum.syns > max_queue_syns) {
+            max_queue_syns = sum.syns;
+            max_queue = queue;
         }
     }
 
-    /* Map FDs are sequenced same as they are defined in the bpf program ie.,
-     * map_fd[0] = rl_config_map, map_fd[1] = rl_window_map
-     * map_fd[2] = rl_recv_count_map, map_fd[3] = rl_drop_count_map
-     * map_fd[4] = rl_ports_map
-     * map_fd[5] = xdp_rl_ingress_next_prog*/
-    if (!map_fd[0]){
-        log_err("Failed to fetch config map");
-        return -1;
+    for (cpu = 0; cpu < nr_cpus; cpu++) {
+        add_queue_stats(&cpus[cpu], &prev_cpus[cpu], -1);
+        add_queue_stats(&prev_cpus[cpu], &cpus[cpu], 1);
+        if (!cpus[cpu].syns)
+            continue;
+        active_cpus++;
+        if (cpus[cpu].syns > max_cpu_syns) {
+            max_cpu_syns = cpus[cpu].syns;
+            max_cpu = cpu;
+        }
     }
-    ret = bpf_map_update_elem(map_fd[0], &ckey, &rate, 0);
-    if (ret) {
-        perror("Failed to update config map");
-        return 1;
+
+    if (!total.syns)
+        goto out;
+
+    /* The queues and the CPUs which saw no SYN count in the mean as well */
+    if (nr_queues < active_queues)
+        nr_queues = active_queues;
+    if (online_cpus < active_cpus)
+        online_cpus = active_cpus;
+    log_info("SYN skew: RX queues %.2f(queue %u with %llu of %llu SYNs over "
+             "%d queues) CPUs %.2f(CPU %u over %d CPUs), cost %.0f ns per "
+             "SYN", (double)max_queue_syns * nr_queues / total.syns,
+             max_queue, max_queue_syns, total.syns, nr_queues,
+             (double)max_cpu_syns * online_cpus / total.syns, max_cpu,
+             online_cpus, (double)total.ns / total.syns);
+out:
+    free(values);
+    free(cpus);
+}
+
+/* Top keys over the limit collected from the batches of rl_hot_map */
+struct hot_top {
+    int top;
+    int nr_top;
+    int nr_keys;
+    __u64 min_drops;
+    __u32 *keys;
+    struct rl_hot_key *hot;
+};
+
+static void collect_hot_keys(const void *keys, const void *values,
+                             __u32 count, void *arg)
+{
+    unsigned int nr_cpus = bpf_num_possible_cpus();
+    const struct rl_hot_key *percpu = values;
+    struct hot_top *t = arg;
+    struct rl_hot_key hot;
+    __u32 n;
+    int i;
+
+    for (n = 0; n < count; n++) {
+        __u32 key = ((const __u32 *)keys)[n];
+
+        rl_reduce_hot_key(&percpu[n * nr_cpus], nr_cpus, key, &hot);
+        if (!hot.drops || hot.drops < t->min_drops)
+            continue;
+        t->nr_keys++;
+        if (t->nr_top == t->top && hot.drops <= t->hot[t->top - 1].drops)
+            continue;
+
+        /* Insertion into the list sorted by drops */
+        i = t->nr_top < t->top ? t->nr_top++ : t->top - 1;
+        for (; i > 0 && t->hot[i - 1].drops < hot.drops; i--) {
+            t->keys[i] = t->keys[i - 1];
+            t->hot[i] = t->hot[i - 1];
+        }
+        t->keys[i] = key;
+        t->hot[i] = hot;
     }
+}
 
-    if (!map_fd[2]) {
-        log_err("Failed to fetch receive count map");
-        return -1;
+/* Log the top keys over the limit, with at least min_drops SYNs dropped */
+static void log_hot_keys(int top, __u64 min_drops)
+{
+    struct hot_top t = {
+        .top = top,
+        .min_drops = min_drops,
+    };
+    __u64 start = time_get_ns(), now;
+    char addr[INET_ADDRSTRLEN];
+    int nr_read, i;
+
+    t.keys = calloc(top, sizeof(*t.keys));
+    t.hot = calloc(top, sizeof(*t.hot));
+    if (!t.keys || !t.hot)
+        goto out;
+
+    nr_read = read_percpu_map(map_fd[RL_HOT_MAP], sizeof(__u32),
+                              sizeof(struct rl_hot_key), collect_hot_keys,
+                              &t);
+    now = time_get_ns();
+    if (nr_read < 0) {
+        log_err("Failed to read the keys over the limit");
+        goto out;
     }
-    ret = bpf_map_update_elem(map_fd[2], &rkey, &recv_count, 0);
-    if (ret) {
-        perror("Failed to update receive count map");
-        return 1;
+
+    log_info("%d keys over the limit with %llu drops or more, %d read in "
+             "%.1f ms", t.nr_keys, min_drops, nr_read,
+             (double)(now - start) / 1000000);
+    for (i = 0; i < t.nr_top; i++) {
+        inet_ntop(AF_INET, &t.keys[i], addr, sizeof(addr));
+        log_info("Key %s: dropped %llu last seen %.1f sec ago", addr,
+                 t.hot[i].drops,
+                 (double)(now - t.hot[i].last_seen) / RL_NANO);
     }
+out:
+    free(t.keys);
+    free(t.hot);
+}
 
-    if (!map_fd[3]) {
-        log_err("Failed to fetch drop count map");
-        return -1;
+/* Log the new connections received and over the limit per protocol */
+static void log_proto_stats(void)
+{
+    static const char *proto_names[RL_PROTO_MAX] = { "TCP", "QUIC" };
+    struct rl_proto_stats stats;
+    __u32 proto;
+
+    for (proto = 0; proto < RL_PROTO_MAX; proto++) {
+        if (bpf_map_lookup_elem(map_fd[RL_PROTO_STATS_MAP], &proto, &stats))
+            continue;
+        log_info("%s connections: received %llu over the limit %llu",
+                 proto_names[proto], stats.recv, stats.drop);
     }
-    ret = bpf_map_update_elem(map_fd[3], &dkey, &drop_count, 0);
-    if (ret) {
-            perror("Failed to update drop count map");
-            return 1;
+}
+
+/* Print the top keys over the limit and the top fingerprints of the running
+ * instances from their pinned maps */
+static int dump_instances(int top, __u64 min_drops)
+{
+    char path[PATH_MAX];
+    size_t j;
+    int i;
+
+    info = stdout;
+    for (i = 0; i < nr_instances; i++) {
+        for (j = 0; j < sizeof(pinned_maps) / sizeof(pinned_maps[0]); j++) {
+            snprintf(path, sizeof(path), "%s/%s/%s/%s", pin_basedir,
+                     pin_subdir, instances[i].ifname, pinned_maps[j].name);
+            map_fd[pinned_maps[j].idx] = bpf_obj_get(path);
+            if (map_fd[pinned_maps[j].idx] < 0) {
+                fprintf(stderr, "no ratelimiting instance on %s\n",
+                        instances[i].ifname);
+                return -1;
+            }
+        }
+        log_info("Interface %s:", instances[i].ifname);
+        log_proto_stats();
+        log_hot_keys(top, min_drops);
+        log_top_fingerprints(top);
+        for (j = 0; j < sizeof(pinned_maps) / sizeof(pinned_maps[0]); j++)
+            close(map_fd[pinned_maps[j].idx]);
     }
-    if (get_length(ports)) {
-        log_info("Configured port list is %s\n", ports);
-        update_ports(ports);
+    return 0;
+}
+
+/* Log the number of SYNs redirected per target */
+static void log_redirect_stats(int nr_cpus)
+{
+    __u32 slot, cpu;
+    __u64 count;
+
+    for (slot = 0; slot < (__u32)(nr_cpus ? nr_cpus : 1); slot++) {
+        if (bpf_map_lookup_elem(map_fd[RL_REDIRECT_COUNT_MAP], &slot, &count))
+            continue;
+        if (nr_cpus &&
+            !bpf_map_lookup_elem(map_fd[RL_REDIRECT_CPUS_MAP], &slot, &cpu))
+            log_info("Redirected to CPU %u: %llu", cpu, count)
+        else
+            log_info("Redirected to device: %llu", count)
     }
+}
 
-    /* Handle signals and exit clean */
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    signal(SIGHUP, signal_handler);
+/* Log the handshake completion ratio per port, a falling ratio indicates
+ * that spoofed SYNs are being admitted */
+static void log_port_stats(void)
+{
+    __u16 first_port = 0, next_port = 0;
+    struct rl_port_stats stats;
+    int first = 1;
 
-    while(1)
+    while (!bpf_map_get_next_key(map_fd[RL_PORT_STATS_MAP],
+                                 first ? NULL : &first_port, &next_port))
+    {
+        first = 0;
+        first_port = next_port;
+        if (bpf_map_lookup_elem(map_fd[RL_PORT_STATS_MAP], &next_port,
+                                &stats))
+            continue;
+        log_info("Port %u: syns %llu admitted %llu completed %llu "
+                 "completion ratio %.2f", next_port, stats.syns,
+                 stats.admitted, stats.completed,
+                 stats.admitted ?
+                 (double)stats.completed / stats.admitted : 0.0);
+    }
+}
+
+static int parse_mode(const char *mode)
+{
+    if (strcmp(mode, "window") == 0)
+        return RL_MODE_WINDOW;
+    if (strcmp(mode, "gcra") == 0)
+        return RL_MODE_GCRA;
+    if (strcmp(mode, "ewma") == 0)
+        return RL_MODE_EWMA;
+
+    fprintf(stderr, "unknown mode %s", mode);
+    return -1;
+}
+
+/* Resize the per-key state tables before they are created */
+static void fixup_map(struct bpf_map_data *map, int idx)
+{
+    if (idx == RL_GCRA_MAP || idx == RL_EWMA_MAP ||
+        idx == RL_REPUTATION_MAP || idx == RL_HALFOPEN_MAP)
+        map->def.max_entries = max_keys;
+
+    /* The instances loaded after the first one reuse its maps when the
+     * state is shared, each instance keeps its own place in its chain and
+     * its own AF_XDP sockets */
+    if (shared_state && nr_loaded && idx != RL_NEXT_PROG_MAP &&
+        idx != RL_XSK_MAP)
+        map->fd = instances[0].map_fd[idx];
+}
+
+/* The helpers work on map_fd, where bpf_load leaves the maps of the object
+ * loaded last, so the maps of the instance are copied back in there */
+static void select_instance(const struct rl_instance *inst)
+{
+    memcpy(map_fd, inst->map_fd, sizeof(inst->map_fd));
+}
+
+/* Add the interfaces of the list as instances */
+static int add_instances(char *ifaces)
+{
+    char *ptr, *tmp, *copy;
+    struct rl_instance *inst;
+
+    tmp = copy = strdup(ifaces);
+    while((ptr = strsep(&tmp, delim)) != NULL)
     {
-        sleep(60);
-        /* Keep deleting the stale map entries periodically *
-         * TODO Check if LRU maps can be used.              */
-        delete_stale_entries();
+        ptr = trim_space(ptr);
+        if (!get_length(ptr))
+            continue;
+        if (nr_instances == MAX_INSTANCES || !if_nametoindex(ptr)) {
+            fprintf(stderr, "invalid interface %s", ptr);
+            free(copy);
+            return -1;
+        }
+        inst = &instances[nr_instances++];
+        snprintf(inst->ifname, sizeof(inst->ifname), "%s", ptr);
+    }
+    free(copy);
+    return 0;
+}
+
+/* Previous program maps are given in the order of the interfaces */
+static int add_prev_prog_maps(char *maps)
+{
+    char *ptr, *tmp, *copy;
+    struct rl_instance *inst;
+
+    tmp = copy = strdup(maps);
+    while((ptr = strsep(&tmp, delim)) != NULL)
+    {
+        ptr = trim_space(ptr);
+        if (!get_length(ptr))
+            continue;
+        if (nr_prev_prog_maps == MAX_INSTANCES) {
+            fprintf(stderr, "too many previous program maps");
+            free(copy);
+            return -1;
+        }
+        inst = &instances[nr_prev_prog_maps++];
+        snprintf(inst->prev_prog_map, sizeof(inst->prev_prog_map), "%s", ptr);
+    }
+    free(copy);
+    return 0;
+}
+
+/* Pin the maps of the instance under pin_basedir/pin_subdir/<interface>,
+ * replacing the pins left over by a previous run */
+static int pin_instance_maps(struct rl_instance *inst)
+{
+    char path[PATH_MAX];
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s/%s", pin_basedir, pin_subdir);
+    if ((mkdir(path, 0700) && errno != EEXIST) ||
+        (mkdir(inst->pin_dir, 0700) && errno != EEXIST)) {
+        log_err("Failed to create pin directory %s", inst->pin_dir);
+        return -1;
+    }
+    for (i = 0; i < sizeof(pinned_maps) / sizeof(pinned_maps[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", inst->pin_dir,
+                 pinned_maps[i].name);
+        remove(path);
+        if (bpf_obj_pin(inst->map_fd[pinned_maps[i].idx], path)) {
+            log_err("Failed to pin %s", path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Netlink request of the tc attach of the SYN-ACK program */
+struct tc_req {
+    struct nlmsghdr nh;
+    struct tcmsg tc;
+    char buf[256];
+};
+
+static void tc_init(struct tc_req *req, int type, int flags, int ifindex,
+                    __u32 parent, __u32 handle, __u32 info)
+{
+    memset(req, 0, sizeof(*req));
+    req->nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+    req->nh.nlmsg_type = type;
+    req->nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    req->tc.tcm_family = AF_UNSPEC;
+    req->tc.tcm_ifindex = ifindex;
+    req->tc.tcm_parent = parent;
+    req->tc.tcm_handle = handle;
+    req->tc.tcm_info = info;
+}
+
+static struct rtattr *tc_add_attr(struct tc_req *req, int type,
+                                  const void *data, int len)
+{
+    struct rtattr *rta = (struct rtattr *)((char *)req +
+                                           NLMSG_ALIGN(req->nh.nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    if (len)
+        memcpy(RTA_DATA(rta), data, len);
+    req->nh.nlmsg_len = NLMSG_ALIGN(req->nh.nlmsg_len) +
+        RTA_ALIGN(rta->rta_len);
+    return rta;
+}
+
+/* Send the request and wait for its ack, returns 0 or a negative errno */
+static int tc_request(struct tc_req *req)
+{
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+    struct nlmsghdr *nh;
+    char buf[4096];
+    int sock, len, ret = -EIO;
+
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0)
+        return -errno;
+    if (sendto(sock, req, req->nh.nlmsg_len, 0, (struct sockaddr *)&sa,
+               sizeof(sa)) < 0) {
+        ret = -errno;
+        goto out;
+    }
+    len = recv(sock, buf, sizeof(buf), 0);
+    if (len < 0) {
+        ret = -errno;
+        goto out;
+    }
+    for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+         nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type == NLMSG_ERROR) {
+            ret = ((struct nlmsgerr *)NLMSG_DATA(nh))->error;
+            break;
+        }
+    }
+out:
+    close(sock);
+    return ret;
+}
+
+/* Remove the SYN-ACK filter of the instance. The clsact qdisc stays, other
+ * programs may have their filters on it. */
+static void detach_synack(struct rl_instance *inst)
+{
+    struct tc_req req;
+
+    if (!inst->synack_obj)
+        return;
+    tc_init(&req, RTM_DELTFILTER, 0, inst->ifindex,
+            TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_EGRESS), SYNACK_TC_HANDLE,
+            TC_H_MAKE(SYNACK_TC_PRIO << 16, htons(ETH_P_ALL)));
+    tc_add_attr(&req, TCA_KIND, "bpf", sizeof("bpf"));
+    if (tc_request(&req))
+        log_err("Failed to detach the SYN-ACK program of %s", inst->ifname);
+    bpf_object__close(inst->synack_obj);
+    inst->synack_obj = NULL;
+}
+
+/* Load the SYN-ACK program of the instance on its flow map and attach it to
+ * the egress of the interface, for the handshakes to be validated against
+ * the ISN of the server. bpf_load doesn't know the classifiers and libbpf of
+ * this kernel has no tc attach, the filter is added over rtnetlink like tc
+ * does. */
+static int attach_synack(struct rl_instance *inst, const char *bpf_obj_file)
+{
+    __u32 flags = TCA_BPF_FLAG_ACT_DIRECT, fd;
+    struct bpf_program *prog;
+    struct bpf_object *obj;
+    struct rtattr *opts;
+    struct bpf_map *map;
+    struct tc_req req;
+    int ret;
+
+    inst->ifindex = if_nametoindex(inst->ifname);
+    obj = bpf_object__open(bpf_obj_file);
+    if (libbpf_get_error(obj)) {
+        log_err("Failed to open SYN-ACK program %s", bpf_obj_file);
+        return -1;
+    }
+    prog = bpf_program__next(NULL, obj);
+    map = bpf_object__find_map_by_name(obj, "rl_syn_flow_map");
+    if (!prog || !map ||
+        bpf_map__reuse_fd(map, inst->map_fd[RL_SYN_FLOW_MAP])) {
+        log_err("Failed to share the flows with the SYN-ACK program");
+        bpf_object__close(obj);
+        return -1;
+    }
+    bpf_program__set_type(prog, BPF_PROG_TYPE_SCHED_CLS);
+    if (bpf_object__load(obj)) {
+        log_err("Failed to load SYN-ACK program %s", bpf_obj_file);
+        bpf_object__close(obj);
+        return -1;
+    }
+    fd = bpf_program__fd(prog);
+
+    tc_init(&req, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, inst->ifindex,
+            TC_H_CLSACT, TC_H_MAKE(TC_H_CLSACT, 0), 0);
+    tc_add_attr(&req, TCA_KIND, "clsact", sizeof("clsact"));
+    ret = tc_request(&req);
+    if (ret && ret != -EEXIST) {
+        log_err("Failed to add the clsact qdisc of %s: %s", inst->ifname,
+                strerror(-ret));
+        bpf_object__close(obj);
+        return -1;
+    }
+
+    /* A filter left by a previous run is replaced */
+    tc_init(&req, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_REPLACE, inst->ifindex,
+            TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_EGRESS), SYNACK_TC_HANDLE,
+            TC_H_MAKE(SYNACK_TC_PRIO << 16, htons(ETH_P_ALL)));
+    tc_add_attr(&req, TCA_KIND, "bpf", sizeof("bpf"));
+    opts = tc_add_attr(&req, TCA_OPTIONS, NULL, 0);
+    tc_add_attr(&req, TCA_BPF_FD, &fd, sizeof(fd));
+    tc_add_attr(&req, TCA_BPF_NAME, bpf_obj_file, strlen(bpf_obj_file) + 1);
+    tc_add_attr(&req, TCA_BPF_FLAGS, &flags, sizeof(flags));
+    opts->rta_len = (char *)&req + req.nh.nlmsg_len - (char *)opts;
+    ret = tc_request(&req);
+    if (ret) {
+        log_err("Failed to attach the SYN-ACK program of %s: %s",
+                inst->ifname, strerror(-ret));
+        bpf_object__close(obj);
+        return -1;
+    }
+    inst->synack_obj = obj;
+    log_info("SYN-ACKs of %s recorded at its egress", inst->ifname);
+    return 0;
+}
+
+/* Load the program of the instance, chain it after the previous program of
+ * its interface and pin its maps */
+static int load_instance(struct rl_instance *inst, const char *bpf_obj_file)
+{
+    int pkey = 0, fd;
+
+    snprintf(inst->pin_dir, sizeof(inst->pin_dir), "%s/%s/%s", pin_basedir,
+             pin_subdir, inst->ifname);
+    /* A single instance keeps the next program map where the chain has
+     * always looked for it */
+    if (nr_instances == 1)
+        snprintf(inst->next_prog_map, sizeof(inst->next_prog_map), "%s",
+                 xdp_rl_ingress_next_prog);
+    else
+        snprintf(inst->next_prog_map, sizeof(inst->next_prog_map), "%s/%s",
+                 inst->pin_dir, next_prog_pin_name);
+
+    if (load_bpf_file_fixup_map(bpf_obj_file, fixup_map)) {
+        log_err("Failed to load bpf program for %s", inst->ifname);
+        return -1;
+    }
+    inst->prog_fd = prog_fd[prog_cnt - 1];
+    if (!inst->prog_fd) {
+        log_err("Failed to get bpf program fd for %s", inst->ifname);
+        return -1;
+    }
+    memcpy(inst->map_fd, map_fd, sizeof(inst->map_fd));
+    nr_loaded++;
+
+    /* Get the previous program's map fd in the chain */
+    fd = bpf_obj_get(inst->prev_prog_map);
+    if (fd < 0) {
+        log_err("Failed to fetch previous xdp function in the chain of %s",
+                inst->ifname);
+        return -1;
+    }
+    /* Update current prog fd in the last prog map fd,
+     * so it can chain the current one */
+    if (bpf_map_update_elem(fd, &pkey, &inst->prog_fd, 0)) {
+        log_err("Failed to update prog fd in the chain of %s", inst->ifname);
+        close(fd);
+        return -1;
+    }
+    /* closing map fd to avoid stale map */
+    close(fd);
+
+    if (pin_instance_maps(inst))
+        return -1;
+
+    fd = bpf_obj_get(inst->next_prog_map);
+    if (fd < 0) {
+        log_info("Failed to fetch next prog map fd, creating one");
+        if (bpf_obj_pin(inst->map_fd[RL_NEXT_PROG_MAP], inst->next_prog_map)) {
+            log_info("Failed to pin next prog fd map");
+            return -1;
+        }
+    } else {
+        close(fd);
+    }
+    return 0;
+}
+
+/* Unchain the program of the instance and remove its pins */
+static void unload_instance(struct rl_instance *inst)
+{
+    char path[PATH_MAX];
+    size_t i;
+
+    detach_synack(inst);
+    xdp_unlink_bpf_chain(inst->prev_prog_map, inst->next_prog_map);
+    for (i = 0; i < sizeof(pinned_maps) / sizeof(pinned_maps[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", inst->pin_dir,
+                 pinned_maps[i].name);
+        remove(path);
+    }
+    rmdir(inst->pin_dir);
+    for (i = 0; i < MAP_COUNT; i++)
+        close(inst->map_fd[i]);
+}
+
+/* Add the cgroups of the list, given as <cgroup v2 path>:<limit> */
+static int add_cgroups(char *list)
+{
+    char *ptr, *tmp, *copy, *limit;
+    struct rl_cgroup *cg;
+
+    tmp = copy = strdup(list);
+    while((ptr = strsep(&tmp, delim)) != NULL)
+    {
+        ptr = trim_space(ptr);
+        if (!get_length(ptr))
+            continue;
+        limit = strrchr(ptr, action_delim[0]);
+        if (nr_cgroups == MAX_CGROUPS || !limit || limit == ptr ||
+            strtoi(limit + 1) <= 0) {
+            fprintf(stderr, "invalid cgroup %s", ptr);
+            free(copy);
+            return -1;
+        }
+        *limit = '\0';
+        cg = &cgroups[nr_cgroups++];
+        snprintf(cg->path, sizeof(cg->path), "%s", ptr);
+        cg->limit = strtoi(limit + 1);
+    }
+    free(copy);
+    return 0;
+}
+
+/* The cgroup storage is keyed by the kernfs id of the cgroup, which is
+ * what its file handle holds */
+static int cgroup_id(const char *path, __u64 *id)
+{
+    struct {
+        struct file_handle fh;
+        __u64 id;
+    } handle;
+    int mount_id;
+
+    handle.fh.handle_bytes = sizeof(handle.id);
+    if (name_to_handle_at(AT_FDCWD, path, &handle.fh, &mount_id, 0) ||
+        handle.fh.handle_bytes != sizeof(*id))
+        return -1;
+    memcpy(id, handle.fh.f_handle, sizeof(*id));
+    return 0;
+}
+
+/* Detach the cgroup program from the cgroups it is attached to */
+static void detach_cgroups(void)
+{
+    while (nr_attached) {
+        struct rl_cgroup *cg = &cgroups[--nr_attached];
+
+        bpf_prog_detach2(cgroup_prog_fd, cg->fd, BPF_CGROUP_INET_INGRESS);
+        close(cg->fd);
+    }
+}
+
+/* Load the cgroup program and attach it to the ingress of every cgroup,
+ * next to the programs already there. Its storage is created by the
+ * attach, the limit of the cgroup is written in it afterwards. */
+static int attach_cgroups(char *bpf_obj_file)
+{
+    struct bpf_cgroup_storage_key key = {
+        .attach_type = BPF_CGROUP_INET_INGRESS,
+    };
+    struct rl_cgroup_state state;
+    struct rl_cgroup *cg;
+    int i;
+
+    if (load_bpf_file(bpf_obj_file)) {
+        log_err("Failed to load cgroup program %s", bpf_obj_file);
+        return -1;
+    }
+    cgroup_prog_fd = prog_fd[prog_cnt - 1];
+    memcpy(cgroup_map_fd, map_fd, sizeof(cgroup_map_fd));
+
+    for (i = 0; i < nr_cgroups; i++) {
+        cg = &cgroups[i];
+        cg->fd = open(cg->path, O_RDONLY | O_DIRECTORY);
+        if (cg->fd < 0 || cgroup_id(cg->path, &cg->id)) {
+            log_err("Failed to open cgroup %s", cg->path);
+            if (cg->fd >= 0)
+                close(cg->fd);
+            return -1;
+        }
+        if (bpf_prog_attach(cgroup_prog_fd, cg->fd, BPF_CGROUP_INET_INGRESS,
+                            BPF_F_ALLOW_MULTI)) {
+            log_err("Failed to attach to cgroup %s", cg->path);
+            close(cg->fd);
+            return -1;
+        }
+        nr_attached++;
+
+        memset(&state, 0, sizeof(state));
+        state.limit = cg->limit;
+        key.cgroup_inode_id = cg->id;
+        if (bpf_map_update_elem(cgroup_map_fd[RL_CGROUP_STORAGE_MAP], &key,
+                                &state, 0)) {
+            log_err("Failed to set the limit of cgroup %s", cg->path);
+            return -1;
+        }
+        log_info("Limiting cgroup %s to %llu connections per sec", cg->path,
+                 cg->limit);
+    }
+    return 0;
+}
+
+/* Passive opens seen and dropped per cgroup */
+static void log_cgroup_stats(void)
+{
+    struct bpf_cgroup_storage_key key = {
+        .attach_type = BPF_CGROUP_INET_INGRESS,
+    };
+    struct rl_cgroup_state state;
+    int i;
+
+    for (i = 0; i < nr_attached; i++) {
+        key.cgroup_inode_id = cgroups[i].id;
+        if (bpf_map_lookup_elem(cgroup_map_fd[RL_CGROUP_STORAGE_MAP], &key,
+                                &state))
+            continue;
+        log_info("Cgroup %s: %llu SYNs, %llu dropped", cgroups[i].path,
+                 state.syns, state.drops);
+    }
+}
+
+/* Load the reuseport program and pin it with the map of the sockets, for
+ * the workers to attach it to their listening sockets and add themselves.
+ * bpf_load doesn't know the sk_reuseport programs, libbpf loads them. The
+ * rate is read from the configuration of the first instance when there is
+ * one. */
+static int load_reuseport(char *bpf_obj_file, __u64 rate)
+{
+    struct bpf_program *prog;
+    struct bpf_map *map;
+    char path[PATH_MAX];
+    __u64 workers = nr_workers;
+    __u32 idx;
+    int i;
+
+    reuseport_obj = bpf_object__open(bpf_obj_file);
+    if (libbpf_get_error(reuseport_obj)) {
+        log_err("Failed to open reuseport program %s", bpf_obj_file);
+        reuseport_obj = NULL;
+        return -1;
+    }
+    prog = bpf_program__next(NULL, reuseport_obj);
+    if (!prog)
+        return -1;
+    bpf_program__set_type(prog, BPF_PROG_TYPE_SK_REUSEPORT);
+    map = bpf_object__find_map_by_name(reuseport_obj,
+                                       reuseport_maps[RL_REUSEPORT_CONFIG_MAP]);
+    if (!map || (nr_loaded &&
+                 bpf_map__reuse_fd(map, instances[0].map_fd[RL_CONFIG_MAP]))) {
+        log_err("Failed to share the configuration with the reuseport program");
+        return -1;
+    }
+    if (bpf_object__load(reuseport_obj)) {
+        log_err("Failed to load reuseport program %s", bpf_obj_file);
+        return -1;
+    }
+    reuseport_prog_fd = bpf_program__fd(prog);
+    for (i = 0; i < REUSEPORT_MAP_COUNT; i++) {
+        map = bpf_object__find_map_by_name(reuseport_obj, reuseport_maps[i]);
+        if (!map)
+            return -1;
+        reuseport_map_fd[i] = bpf_map__fd(map);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", pin_basedir, pin_subdir);
+    if (mkdir(path, 0700) && errno != EEXIST) {
+        log_err("Failed to create pin directory %s", path);
+        return -1;
+    }
+    remove(reuseport_prog);
+    remove(reuseport_socks_map);
+    if (bpf_obj_pin(reuseport_prog_fd, reuseport_prog) ||
+        bpf_obj_pin(reuseport_map_fd[RL_REUSEPORT_SOCKS_MAP],
+                    reuseport_socks_map)) {
+        log_err("Failed to pin the reuseport program");
+        return -1;
+    }
+
+    /* Without an instance the program has its own configuration, only the
+     * rate and the number of workers are used */
+    if (!nr_loaded) {
+        idx = RL_CONFIG_RATE;
+        if (bpf_map_update_elem(reuseport_map_fd[RL_REUSEPORT_CONFIG_MAP],
+                                &idx, &rate, 0))
+            return -1;
+        idx = RL_CONFIG_WORKERS;
+        if (bpf_map_update_elem(reuseport_map_fd[RL_REUSEPORT_CONFIG_MAP],
+                                &idx, &workers, 0))
+            return -1;
+    }
+    log_info("Sharing the rate between %d workers, reuseport program "
+             "pinned at %s", nr_workers, reuseport_prog);
+    return 0;
+}
+
+/* Remove the pins of the reuseport program, the workers keep it attached
+ * till they close their sockets */
+static void unload_reuseport(void)
+{
+    if (!reuseport_obj)
+        return;
+    remove(reuseport_prog);
+    remove(reuseport_socks_map);
+    bpf_object__close(reuseport_obj);
+    reuseport_obj = NULL;
+}
+
+/* SYNs taken within and beyond their share per worker */
+static void log_worker_stats(void)
+{
+    struct rl_worker_state state;
+    __u32 idx;
+
+    for (idx = 0; idx < (__u32)nr_workers; idx++) {
+        if (bpf_map_lookup_elem(reuseport_map_fd[RL_WORKER_MAP], &idx,
+                                &state))
+            continue;
+        log_info("Worker %u: %llu SYNs, %llu over its share", idx,
+                 state.syns, state.overflows);
+    }
+}
+
+/* Unlink xdp kernel program on receiving KILL/INT signals */
+static void signal_handler(int signal)
+{
+    log_info("Received signal %d", signal);
+    int i = 0;
+    for(i=0; i<nr_loaded;i++) {
+       unload_instance(&instances[i]);
+    }
+    detach_cgroups();
+    unload_reuseport();
+    if (info != NULL)
+        fclose(info);
+    exit(EXIT_SUCCESS);
+}
+
+/* Half-life shift in RL_EWMA_TS_SHIFT time units, rounded to the nearest
+ * power of two so the XDP program can decay with shifts only */
+static __u32 ewma_shift(__u64 half_life_ms)
+{
+    __u64 units = (half_life_ms * 1000000) >> RL_EWMA_TS_SHIFT;
+    __u32 shift = 0;
+
+    while (shift < 31 && (1ULL << (shift + 1)) <= units + (units >> 1))
+        shift++;
+    return shift;
+}
+
+/* Steady state EWMA estimate of a key sending rate connections per second.
+ * With a half-life of H seconds the estimate settles at rate * H / ln(2) */
+static __u64 ewma_limit(__u64 rate, __u32 shift)
+{
+    double half_life = (double)(1ULL << shift) *
+        (1ULL << RL_EWMA_TS_SHIFT) / RL_NANO;
+
+    return (__u64)(rate * half_life / M_LN2 * (1 << RL_EWMA_FRAC_BITS));
+}
+
+/* Configuration last written to rl_config_map, kept for the rate changes
+ * of the quota sync */
+static __u64 config[RL_CONFIG_MAX];
+static __u64 config_burst;
+
+/* Fill in the values derived from the rate, computed here so that the XDP
+ * program does not divide per packet */
+static void rate_config(__u64 rate)
+{
+    __u64 burst = config_burst;
+
+    config[RL_CONFIG_RATE] = rate;
+    config[RL_CONFIG_GCRA_INTERVAL] = 0;
+    config[RL_CONFIG_GCRA_TOLERANCE] = 0;
+    if (rate) {
+        config[RL_CONFIG_GCRA_INTERVAL] = RL_NANO / rate;
+        /* Allow a burst of connections back to back, one second worth of
+         * connections by default */
+        if (!burst)
+            burst = rate;
+        config[RL_CONFIG_GCRA_TOLERANCE] =
+            (burst - 1) * config[RL_CONFIG_GCRA_INTERVAL];
+    }
+    if (config[RL_CONFIG_MODE] == RL_MODE_EWMA)
+        config[RL_CONFIG_EWMA_LIMIT] =
+            ewma_limit(rate, config[RL_CONFIG_EWMA_SHIFT]);
+}
+
+/* The ramp grows the limits linearly from ramp_floor connections per second
+ * to the rate over duration ns, starting now. The XDP program computes the
+ * limits from the epoch. */
+static void ramp_config(__u64 rate, __u64 duration, __u64 ramp_floor)
+{
+    __u64 units = duration >> RL_RAMP_TS_SHIFT;
+
+    if (!rate || !units)
+        return;
+    /* A zero fraction would lift the GCRA limit rather than close it */
+    if (!ramp_floor)
+        ramp_floor = 1;
+    if (ramp_floor > rate)
+        ramp_floor = rate;
+    config[RL_CONFIG_RAMP_DURATION] = duration;
+    config[RL_CONFIG_RAMP_FLOOR] = (__u64)((double)ramp_floor / rate *
+                                           RL_RAMP_ONE);
+    if (!config[RL_CONFIG_RAMP_FLOOR])
+        config[RL_CONFIG_RAMP_FLOOR] = 1;
+    config[RL_CONFIG_RAMP_SLOPE] =
+        (RL_RAMP_ONE - config[RL_CONFIG_RAMP_FLOOR]) / units;
+    config[RL_CONFIG_RAMP_EPOCH] = time_get_ns();
+}
+
+/* Start the ramp over from now, on SIGUSR1 */
+static void restart_ramp(int signal)
+{
+    __u32 idx = RL_CONFIG_RAMP_EPOCH;
+    __u64 epoch = time_get_ns();
+    int i;
+
+    if (!config[RL_CONFIG_RAMP_DURATION])
+        return;
+    config[RL_CONFIG_RAMP_EPOCH] = epoch;
+    for (i = 0; i < (shared_state ? 1 : nr_loaded); i++)
+        bpf_map_update_elem(instances[i].map_fd[RL_CONFIG_MAP], &idx, &epoch,
+                            0);
+}
+
+/* Flags of the xsk redirect. From kernel 5.3 the flags of bpf_redirect_map
+ * give the action for a queue without a socket, the older kernels abort
+ * on any flag. */
+static __u64 xsk_flags(void)
+{
+    struct utsname u;
+    int major, minor;
+
+    if (uname(&u) || sscanf(u.release, "%d.%d", &major, &minor) != 2)
+        return 0;
+    return major > 5 || (major == 5 && minor >= 3) ? XDP_DROP : 0;
+}
+
+/* Fill in the limiter configuration */
+static int update_config(__u64 rate, int mode, __u64 burst, int prefix_len,
+                         __u64 half_life, __u64 source_rate, __u64 headroom,
+                         int retrans, int reputation, __u64 reputation_ttl,
+                         __u64 halfopen_max, __u64 halfopen_timeout,
+                         __u64 max_concurrent, __u64 rst_rate,
+                         __u64 mark_dscp, int mark_flow, __u64 premium_rate,
+                         __u64 redirect_cpus, __u64 nr_classes,
+                         int fingerprint, __u64 fp_rate, int decap,
+                         __u64 gue_port, __u64 vxlan_port, int queue_stats,
+                         __u64 ramp, __u64 ramp_floor, int hot_keys,
+                         __u64 workers)
+{
+    __u32 idx;
+
+    memset(config, 0, sizeof(config));
+    config[RL_CONFIG_MODE] = mode;
+    config[RL_CONFIG_KEY_MASK] = prefix_len ?
+        htonl(0xffffffffU << (32 - prefix_len)) : 0;
+    config[RL_CONFIG_EWMA_SHIFT] = ewma_shift(half_life);
+    config_burst = burst;
+    rate_config(rate);
+    if (mode != RL_MODE_EWMA && source_rate) {
+        config[RL_CONFIG_EWMA_SCORE] = 1;
+        config[RL_CONFIG_EWMA_LIMIT] =
+            ewma_limit(source_rate, config[RL_CONFIG_EWMA_SHIFT]);
+    }
+    config[RL_CONFIG_PRIORITY_HEADROOM] = headroom;
+    config[RL_CONFIG_EWMA_HEADROOM] =
+        ewma_limit(headroom, config[RL_CONFIG_EWMA_SHIFT]);
+    config[RL_CONFIG_RETRANS] = retrans;
+    config[RL_CONFIG_REPUTATION] = reputation;
+    config[RL_CONFIG_REPUTATION_TTL] = reputation_ttl * RL_NANO;
+    config[RL_CONFIG_HALFOPEN_MAX] = halfopen_max;
+    config[RL_CONFIG_HALFOPEN_TIMEOUT] = halfopen_timeout * RL_NANO;
+    config[RL_CONFIG_MAX_CONCURRENT] = max_concurrent;
+    config[RL_CONFIG_TRACK_HANDSHAKE] =
+        reputation || halfopen_max || max_concurrent;
+    config[RL_CONFIG_RST_RATE] = rst_rate;
+    config[RL_CONFIG_MARK_DSCP] = mark_dscp;
+    config[RL_CONFIG_MARK_FLOW] = mark_flow;
+    config[RL_CONFIG_PREMIUM_RATE] = premium_rate;
+    config[RL_CONFIG_REDIRECT_CPUS] = redirect_cpus;
+    config[RL_CONFIG_CLASSES] = nr_classes;
+    config[RL_CONFIG_FP] = fingerprint;
+    config[RL_CONFIG_FP_RATE] = fp_rate;
+    config[RL_CONFIG_DECAP] = decap;
+    config[RL_CONFIG_GUE_PORT] = gue_port;
+    config[RL_CONFIG_VXLAN_PORT] = vxlan_port;
+    config[RL_CONFIG_QUEUE_STATS] = queue_stats;
+    ramp_config(rate, ramp * RL_NANO, ramp_floor);
+    config[RL_CONFIG_HOT_KEYS] = hot_keys;
+    config[RL_CONFIG_WORKERS] = workers;
+    config[RL_CONFIG_XSK_FLAGS] = xsk_flags();
+
+    for (idx = 0; idx < RL_CONFIG_MAX; idx++) {
+        if (bpf_map_update_elem(map_fd[RL_CONFIG_MAP], &idx, &config[idx], 0))
+            return -1;
+    }
+    return 0;
+}
+
+/* Change the rate, for the local share of the fleet budget */
+static int update_rate(__u64 rate)
+{
+    static const __u32 rate_idx[] = {
+        RL_CONFIG_RATE,
+        RL_CONFIG_GCRA_INTERVAL,
+        RL_CONFIG_GCRA_TOLERANCE,
+        RL_CONFIG_EWMA_LIMIT,
+    };
+    size_t i;
+
+    rate_config(rate);
+    for (i = 0; i < sizeof(rate_idx) / sizeof(rate_idx[0]); i++) {
+        if (bpf_map_update_elem(map_fd[RL_CONFIG_MAP], &rate_idx[i],
+                                &config[rate_idx[i]], 0))
+            return -1;
+    }
+    return 0;
+}
+
+/* Quota sync between the daemons of a fleet sharing one budget. Every sync
+ * interval each daemon sends to its peers the SYNs it received(its demand)
+ * and admitted during the interval, and sets its own rate to its share of
+ * the fleet budget: a floor of SYNC_SHARE_FLOOR percent split evenly and
+ * the rest in proportion to the demand. Peers not heard from for the sync
+ * timeout keep their even share of the budget reserved, in case they are
+ * only cut off from the others. See the README for the bounds. */
+struct rl_sync_msg {
+    __u32 magic;
+    __u32 version;
+    __u64 boot;                 /* Drawn at start, a restarted daemon
+                                 * numbers its reports from 1 again */
+    __u64 seq;
+    __u64 demand;
+    __u64 admitted;
+};
+
+struct rl_sync_peer {
+    struct sockaddr_in addr;
+    __u64 boot;
+    __u64 seq;
+    __u64 demand;
+    __u64 admitted;
+    __u64 last_seen;
+};
+
+static struct rl_sync_peer sync_peers[MAX_SYNC_PEERS];
+static int nr_sync_peers, sync_fd = -1;
+static __u64 sync_boot;
+
+/* Addresses are given as ipv4:port */
+static int parse_sockaddr(char *str, struct sockaddr_in *addr)
+{
+    char *ip = strsep(&str, action_delim);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if (!str || inet_pton(AF_INET, trim_space(ip), &addr->sin_addr) != 1)
+        return -1;
+    addr->sin_port = htons((__u16)strtoi(trim_space(str)));
+    return 0;
+}
+
+static int add_sync_peers(char *peers)
+{
+    char *ptr, *tmp, *copy;
+
+    tmp = copy = strdup(peers);
+    while((ptr = strsep(&tmp, delim)) != NULL)
+    {
+        ptr = trim_space(ptr);
+        if (!get_length(ptr))
+            continue;
+        if (nr_sync_peers == MAX_SYNC_PEERS ||
+            parse_sockaddr(ptr, &sync_peers[nr_sync_peers].addr)) {
+            fprintf(stderr, "invalid sync peer %s", ptr);
+            free(copy);
+            return -1;
+        }
+        nr_sync_peers++;
+    }
+    free(copy);
+    return 0;
+}
+
+static int sync_open(char *bind_addr)
+{
+    struct sockaddr_in addr;
+    struct timespec ts;
+
+    if (parse_sockaddr(bind_addr, &addr)) {
+        log_err("Invalid sync address %s", bind_addr);
+        return -1;
+    }
+    sync_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sync_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(sync_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("bind");
+        close(sync_fd);
+        sync_fd = -1;
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    sync_boot = ((__u64)ts.tv_sec * RL_NANO + ts.tv_nsec) ^
+        ((__u64)getpid() << 32);
+    return 0;
+}
+
+static void sync_send(__u64 seq, __u64 demand, __u64 admitted)
+{
+    struct rl_sync_msg msg = {
+        .magic = htonl(SYNC_MAGIC),
+        .version = htonl(SYNC_VERSION),
+        .boot = htobe64(sync_boot),
+        .seq = htobe64(seq),
+        .demand = htobe64(demand),
+        .admitted = htobe64(admitted),
+    };
+    int i;
+
+    for (i = 0; i < nr_sync_peers; i++) {
+        if (sendto(sync_fd, &msg, sizeof(msg), 0,
+                   (struct sockaddr *)&sync_peers[i].addr,
+                   sizeof(sync_peers[i].addr)) < 0)
+            log_debug("Failed to send the sync report to peer %d", i);
+    }
+}
+
+/* Drain the reports received, only the latest one of every known peer is
+ * kept. A report from a new boot of the peer replaces the ones of the
+ * previous boot whatever its sequence number. */
+static void sync_receive(__u64 now)
+{
+    struct rl_sync_msg msg;
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    int i;
+
+    while (recvfrom(sync_fd, &msg, sizeof(msg), 0, (struct sockaddr *)&from,
+                    &len) == sizeof(msg)) {
+        len = sizeof(from);
+        if (ntohl(msg.magic) != SYNC_MAGIC ||
+            ntohl(msg.version) != SYNC_VERSION)
+            continue;
+        for (i = 0; i < nr_sync_peers; i++) {
+            struct rl_sync_peer *peer = &sync_peers[i];
+
+            if (peer->addr.sin_addr.s_addr != from.sin_addr.s_addr ||
+                peer->addr.sin_port != from.sin_port)
+                continue;
+            if (be64toh(msg.boot) != peer->boot ||
+                be64toh(msg.seq) > peer->seq) {
+                peer->boot = be64toh(msg.boot);
+                peer->seq = be64toh(msg.seq);
+                peer->demand = be64toh(msg.demand);
+                peer->admitted = be64toh(msg.admitted);
+                peer->last_seen = now;
+            }
+            break;
+        }
+    }
+}
+
+/* Local share of the fleet budget, see struct rl_sync_msg */
+static __u64 sync_share(__u64 budget, __u64 demand, __u64 now,
+                        __u64 timeout, int *nr_live)
+{
+    double total = demand, share;
+    int nr_hosts = nr_sync_peers + 1, i;
+
+    *nr_live = 1;
+    for (i = 0; i < nr_sync_peers; i++) {
+        if (!sync_peers[i].last_seen ||
+            now - sync_peers[i].last_seen > timeout)
+            continue;
+        total += sync_peers[i].demand;
+        (*nr_live)++;
+    }
+
+    /* The silent peers keep their even share */
+    share = (double)budget * *nr_live / nr_hosts;
+    if (total > 0)
+        share = share * SYNC_SHARE_FLOOR / 100 / *nr_live +
+            share * (100 - SYNC_SHARE_FLOOR) / 100 * demand / total;
+    else
+        share /= *nr_live;
+    return share < 1 ? 1 : (__u64)share;
+}
+
+/* Counter of the first instance, the sync runs on a single budget */
+static __u64 read_count(int idx)
+{
+    __u64 key = 0, count = 0;
+
+    bpf_map_lookup_elem(instances[0].map_fd[idx], &key, &count);
+    return count;
+}
+
+/* One round of the quota sync, returns the local share */
+static __u64 sync_quota(__u64 budget, __u64 timeout, int log)
+{
+    static __u64 seq, prev_recv, prev_drop;
+    __u64 now = time_get_ns(), recv, drop, demand, admitted, share;
+    int nr_live;
+
+    recv = read_count(RL_RECV_COUNT_MAP) + read_count(RL_RETRANS_COUNT_MAP);
+    drop = read_count(RL_DROP_COUNT_MAP);
+    demand = recv - prev_recv;
+    admitted = demand > drop - prev_drop ? demand - (drop - prev_drop) : 0;
+    prev_recv = recv;
+    prev_drop = drop;
+
+    sync_send(++seq, demand, admitted);
+    sync_receive(now);
+    share = sync_share(budget, demand, now, timeout, &nr_live);
+
+    select_instance(&instances[0]);
+    if (config[RL_CONFIG_RATE] != share && update_rate(share))
+        log_err("Failed to update the rate to %llu", share);
+    if (log) {
+        log_info("Sync: %d of %d hosts live, local demand %llu admitted %llu "
+                 "share %llu of %llu", nr_live, nr_sync_peers + 1, demand,
+                 admitted, share, budget);
+    }
+    return share;
+}
+
+int main(int argc, char **argv)
+{
+    int longindex = 0, rate = 0, opt;
+    int mode = RL_MODE_WINDOW, prefix_len = 32, burst = 0;
+    int half_life = 1000, source_rate = 0, headroom = 0, retrans = 0;
+    int reputation = 0, reputation_ttl = 600;
+    int halfopen_max = 0, halfopen_timeout = 60;
+    int max_concurrent = 0, conn_idle_timeout = 300;
+    int action = RL_ACTION_DROP, rst_rate = 1000;
+    int mark_dscp = RL_DSCP_LE, mark_flow = 0, premium_rate = 0;
+    /* EF and AF4x */
+    char premium_dscp[256] = "46,34,36,38";
+    char redirect_cpus[1024];
+    int redirect_ifindex = 0, nr_redirect_cpus = 0;
+    int ret = EXIT_SUCCESS;
+    char bpf_obj_file[256];
+    char cgroup_obj_file[256];
+    char reuseport_obj_file[256];
+    char synack_obj_file[256];
+    char ports[2048];
+    char quic_ports[2048];
+    char classes[2048];
+    int nr_classes = 0;
+    int fingerprint = 0, fp_rate = 0, fp_top = FP_TOP_DEFAULT;
+    char fp_limits[2048];
+    int decap = 0, gue_port = 0, vxlan_port = VXLAN_PORT_DEFAULT;
+    int queue_stats = 0, nr_managed, i;
+    char sync_bind[64];
+    int sync_interval = 1, sync_timeout = 0, elapsed = 0;
+    int ramp = 0, ramp_floor = -1;
+    int hot_keys = 0, dump = 0, dump_top = DUMP_TOP_DEFAULT, dump_min = 1;
+    verbosity = LOG_INFO;
+    struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+    int len = 0;
+    snprintf(bpf_obj_file, sizeof(bpf_obj_file), "%s_kern.o", argv[0]);
+    snprintf(cgroup_obj_file, sizeof(cgroup_obj_file), "%s_cgroup_kern.o",
+             argv[0]);
+    snprintf(reuseport_obj_file, sizeof(reuseport_obj_file),
+             "%s_reuseport_kern.o", argv[0]);
+    snprintf(synack_obj_file, sizeof(synack_obj_file), "%s_synack_kern.o",
+             argv[0]);
+
+    memset(&ports, 0, 2048);
+    memset(&quic_ports, 0, sizeof(quic_ports));
+    memset(&classes, 0, sizeof(classes));
+    memset(&fp_limits, 0, sizeof(fp_limits));
+    memset(&sync_bind, 0, sizeof(sync_bind));
+    memset(&redirect_cpus, 0, sizeof(redirect_cpus));
+
+    /* Parse commands line args */
+    while ((opt = getopt_long(argc, argv, "h", long_options, &longindex)) != -1)
+    {
+        switch (opt) {
+            case 'r':
+                rate = strtoi(optarg);
+                break;
+            case 'i':
+                if (add_instances(optarg))
+                    return EXIT_FAILURE;
+                break;
+            case 'v':
+                if(optarg) {
+                    verbosity = strtoi(optarg);
+                }
+                break;
+            case 'm':
+                if (optarg && add_prev_prog_maps(optarg))
+                    return EXIT_FAILURE;
+                break;
+            case 'p':
+                if(optarg) {
+                    len = get_length(optarg);
+                    strncpy(ports, optarg, len);
+                    ports[len] = '\0';
+                }
+                break;
+            case 'q':
+                len = get_length(optarg);
+                if (len >= (int)sizeof(quic_ports)) {
+                    fprintf(stderr, "QUIC port list too long");
+                    return EXIT_FAILURE;
+                }
+                strncpy(quic_ports, optarg, len);
+                quic_ports[len] = '\0';
+                break;
+            case 'w':
+                len = get_length(optarg);
+                if (len >= (int)sizeof(classes)) {
+                    fprintf(stderr, "traffic class list too long");
+                    return EXIT_FAILURE;
+                }
+                strncpy(classes, optarg, len);
+                classes[len] = '\0';
+                break;
+            case 'n':
+                fingerprint = 1;
+                break;
+            case 'f':
+                fp_rate = strtoi(optarg);
+                fingerprint = 1;
+                break;
+            case 'L':
+                len = get_length(optarg);
+                if (len >= (int)sizeof(fp_limits)) {
+                    fprintf(stderr, "fingerprint limit list too long");
+                    return EXIT_FAILURE;
+                }
+                strncpy(fp_limits, optarg, len);
+                fp_limits[len] = '\0';
+                fingerprint = 1;
+                break;
+            case 't':
+                fp_top = strtoi(optarg);
+                break;
+            case 'E':
+                decap = 1;
+                break;
+            case 'U':
+                gue_port = strtoi(optarg);
+                decap = 1;
+                break;
+            case 'V':
+                vxlan_port = strtoi(optarg);
+                decap = 1;
+                break;
+            case 'Q':
+                queue_stats = 1;
+                break;
+            case 'S':
+                if (strcmp(optarg, "shared") == 0) {
+                    shared_state = 1;
+                } else if (strcmp(optarg, "isolated") != 0) {
+                    fprintf(stderr, "state must be shared or isolated");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                len = get_length(optarg);
+                if (len >= (int)sizeof(sync_bind)) {
+                    fprintf(stderr, "sync address too long");
+                    return EXIT_FAILURE;
+                }
+                strncpy(sync_bind, optarg, len);
+                sync_bind[len] = '\0';
+                break;
+            case 'N':
+                if (add_sync_peers(optarg))
+                    return EXIT_FAILURE;
+                break;
+            case 'I':
+                sync_interval = strtoi(optarg);
+                if (sync_interval <= 0) {
+                    fprintf(stderr, "sync interval must be positive");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'W':
+                sync_timeout = strtoi(optarg);
+                break;
+            case 'A':
+                ramp = strtoi(optarg);
+                break;
+            case 'K':
+                hot_keys = 1;
+                break;
+            case 'Z':
+                dump = 1;
+                break;
+            case 'Y':
+                dump_top = strtoi(optarg);
+                break;
+            case 'z':
+                dump_min = strtoi(optarg);
+                break;
+            case 'y':
+                ramp_floor = strtoi(optarg);
+                break;
+            case 'j':
+                if (add_cgroups(optarg))
+                    return EXIT_FAILURE;
+                break;
+            case 'J':
+                nr_workers = strtoi(optarg);
+                if (nr_workers <= 0 || nr_workers > RL_MAX_WORKERS) {
+                    fprintf(stderr, "workers must be within 1-%d",
+                            RL_MAX_WORKERS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                /* Not honoured as of now */
+                break;
+            case 'M':
+                mode = parse_mode(optarg);
+                if (mode < 0) {
+                    usage(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                burst = strtoi(optarg);
+                break;
+            case 'l':
+                prefix_len = strtoi(optarg);
+                if (prefix_len < 0 || prefix_len > 32) {
+                    fprintf(stderr, "prefix length must be within 0-32");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'k':
+                max_keys = (__u32)strtoi(optarg);
+                break;
+            case 'H':
+                half_life = strtoi(optarg);
+                break;
+            case 's':
+                source_rate = strtoi(optarg);
+                break;
+            case 'P':
+                headroom = strtoi(optarg);
+                break;
+            case 'R':
+                retrans = 1;
+                break;
+            case 'g':
+                reputation = 1;
+                break;
+            case 'G':
+                reputation_ttl = strtoi(optarg);
+                break;
+            case 'o':
+                halfopen_max = strtoi(optarg);
+                break;
+            case 'O':
+                halfopen_timeout = strtoi(optarg);
+                break;
+            case 'c':
+                max_concurrent = strtoi(optarg);
+                break;
+            case 'C':
+                conn_idle_timeout = strtoi(optarg);
+                break;
+            case 'a':
+                action = parse_action(optarg);
+                if (action < 0) {
+                    usage(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                rst_rate = strtoi(optarg);
+                break;
+            case 'D':
+                mark_dscp = strtoi(optarg);
+                if (mark_dscp < 0 || mark_dscp > 63) {
+                    fprintf(stderr, "DSCP must be within 0-63");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'F':
+                mark_flow = 1;
+                break;
+            case 'x':
+                premium_rate = strtoi(optarg);
+                break;
+            case 'X':
+                len = get_length(optarg);
+                if (len >= (int)sizeof(premium_dscp)) {
+                    fprintf(stderr, "premium DSCP list too long");
+                    return EXIT_FAILURE;
+                }
+                strncpy(premium_dscp, optarg, len);
+                premium_dscp[len] = '\0';
+                break;
+            case 'e':
+                redirect_ifindex = if_nametoindex(optarg);
+                if (!redirect_ifindex) {
+                    fprintf(stderr, "unknown redirect device %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                len = get_length(optarg);
+                if (len >= (int)sizeof(redirect_cpus)) {
+                    fprintf(stderr, "redirect CPU list too long");
+                    return EXIT_FAILURE;
+                }
+                strncpy(redirect_cpus, optarg, len);
+                redirect_cpus[len] = '\0';
+                break;
+            case 'h':
+            default:
+                usage(argv);
+                return EXIT_FAILURE;
+        }
+    }
+    /* Dumps are read from the maps pinned by the running daemon */
+    if (dump) {
+        if (!nr_instances || dump_top <= 0) {
+            usage(argv);
+            return EXIT_FAILURE;
+        }
+        return dump_instances(dump_top, dump_min) ? EXIT_FAILURE :
+            EXIT_SUCCESS;
+    }
+    /* Only the cgroups or the workers are limited when no interface is
+     * given */
+    if ((!nr_instances && !nr_cgroups && !nr_workers) ||
+        nr_prev_prog_maps != nr_instances) {
+        fprintf(stderr, "one previous program map is needed per interface");
+        usage(argv);
+        return EXIT_FAILURE;
+    }
+    if (get_length(sync_bind) &&
+        (!nr_sync_peers || !nr_instances ||
+         (nr_instances > 1 && !shared_state))) {
+        fprintf(stderr, "the quota sync needs peers and a single budget");
+        return EXIT_FAILURE;
+    }
+    if (get_length(quic_ports) && check_quic_actions(quic_ports, action)) {
+        fprintf(stderr, "the QUIC ports take the drop, mark and redirect "
+                "actions");
+        return EXIT_FAILURE;
+    }
+    if (nr_workers && rate <= 0) {
+        fprintf(stderr, "the workers share the rate, which must be positive");
+        return EXIT_FAILURE;
+    }
+    if (nr_workers && mode != RL_MODE_WINDOW) {
+        fprintf(stderr, "the workers share the global window, the rate is "
+                "per key in the gcra and ewma modes");
+        return EXIT_FAILURE;
+    }
+    if (!sync_timeout)
+        sync_timeout = SYNC_TIMEOUT_INTERVALS * sync_interval;
+    if (ramp_floor < 0)
+        ramp_floor = rate * RAMP_FLOOR_PERCENT / 100;
+    if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+        perror("setrlimit(RLIMIT_MEMLOCK)");
+        exit(EXIT_FAILURE);
+    }
+    set_logfile();
+
+    __u64 rkey = 0, dkey = 0;
+    __u64 recv_count = 0, drop_count = 0, retrans_count = 0, rst_count = 0;
+    __u64 mark_count = 0, xsk_count = 0;
+
+    for (i = 0; i < nr_instances; i++) {
+        /* The handshakes are only taken as complete with the SYN-ACKs
+         * recorded */
+        if (load_instance(&instances[i], bpf_obj_file) ||
+            ((reputation || halfopen_max || max_concurrent) &&
+             attach_synack(&instances[i], synack_obj_file))) {
+            while (nr_loaded)
+                unload_instance(&instances[--nr_loaded]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((nr_cgroups && attach_cgroups(cgroup_obj_file)) ||
+        (nr_workers && load_reuseport(reuseport_obj_file, rate))) {
+        while (nr_loaded)
+            unload_instance(&instances[--nr_loaded]);
+        detach_cgroups();
+        unload_reuseport();
+        exit(EXIT_FAILURE);
+    }
+
+    /* Instances sharing their state are configured and reported once */
+    nr_managed = shared_state && nr_instances ? 1 : nr_instances;
+    for (i = 0; i < nr_managed; i++) {
+        select_instance(&instances[i]);
+        /* Map FDs are sequenced same as they are defined in the bpf program,
+         * see enum rl_map_idx */
+        if (!map_fd[RL_CONFIG_MAP]){
+            log_err("Failed to fetch config map");
+            return -1;
+        }
+        /* The redirect targets and the traffic classes go first as their
+         * number is configured */
+        nr_redirect_cpus = update_redirect(redirect_ifindex, redirect_cpus);
+        if (get_length(classes)) {
+            log_info("Configured traffic classes are %s", classes);
+            nr_classes = update_classes(classes);
+        }
+
+        ret = update_config(rate, mode, burst, prefix_len, half_life,
+                            source_rate, headroom, retrans, reputation,
+                            reputation_ttl,
+                            halfopen_max, halfopen_timeout, max_concurrent,
+                            rst_rate, mark_dscp, mark_flow, premium_rate,
+                            nr_redirect_cpus, nr_classes, fingerprint, fp_rate,
+                            decap, gue_port, vxlan_port, queue_stats, ramp,
+                            ramp_floor, hot_keys, nr_workers);
+        if (ret) {
+            perror("Failed to update config map");
+            return 1;
+        }
+
+        if (!map_fd[RL_RECV_COUNT_MAP]) {
+            log_err("Failed to fetch receive count map");
+            return -1;
+        }
+        ret = bpf_map_update_elem(map_fd[RL_RECV_COUNT_MAP], &rkey,
+                                  &recv_count, 0);
+        if (ret) {
+            perror("Failed to update receive count map");
+            return 1;
+        }
+
+        if (!map_fd[RL_DROP_COUNT_MAP]) {
+            log_err("Failed to fetch drop count map");
+            return -1;
+        }
+        ret = bpf_map_update_elem(map_fd[RL_DROP_COUNT_MAP], &dkey,
+                                  &drop_count, 0);
+        if (ret) {
+                perror("Failed to update drop count map");
+                return 1;
+        }
+
+        if (!map_fd[RL_RETRANS_COUNT_MAP]) {
+            log_err("Failed to fetch retransmit count map");
+            return -1;
+        }
+        ret = bpf_map_update_elem(map_fd[RL_RETRANS_COUNT_MAP], &rkey,
+                                  &retrans_count, 0);
+        if (ret) {
+            perror("Failed to update retransmit count map");
+            return 1;
+        }
+
+        if (!map_fd[RL_RST_COUNT_MAP]) {
+            log_err("Failed to fetch RST count map");
+            return -1;
+        }
+        ret = bpf_map_update_elem(map_fd[RL_RST_COUNT_MAP], &rkey,
+                                  &rst_count, 0);
+        if (ret) {
+            perror("Failed to update RST count map");
+            return 1;
+        }
+
+        if (!map_fd[RL_MARK_COUNT_MAP]) {
+            log_err("Failed to fetch mark count map");
+            return -1;
+        }
+        ret = bpf_map_update_elem(map_fd[RL_MARK_COUNT_MAP], &rkey,
+                                  &mark_count, 0);
+        if (ret) {
+            perror("Failed to update mark count map");
+            return 1;
+        }
+
+        if (!map_fd[RL_XSK_COUNT_MAP]) {
+            log_err("Failed to fetch xsk count map");
+            return -1;
+        }
+        ret = bpf_map_update_elem(map_fd[RL_XSK_COUNT_MAP], &rkey,
+                                  &xsk_count, 0);
+        if (ret) {
+            perror("Failed to update xsk count map");
+            return 1;
+        }
+        if (get_length(ports)) {
+            log_info("Configured port list is %s\n", ports);
+            update_ports(ports, action, RL_PORTS_MAP);
+        }
+        if (get_length(quic_ports)) {
+            log_info("Configured QUIC port list is %s\n", quic_ports);
+            update_ports(quic_ports, action, RL_QUIC_PORTS_MAP);
+        }
+        if (get_length(fp_limits)) {
+            log_info("Configured fingerprint limits are %s", fp_limits);
+            update_fp_limits(fp_limits);
+        }
+        if (queue_stats) {
+            instances[i].nr_queues = count_rx_queues(instances[i].ifname);
+            log_info("Counting the SYNs over %d RX queues of %s",
+                     instances[i].nr_queues, instances[i].ifname);
+        }
+        if (premium_rate) {
+            log_info("Premium DSCP list is %s, reserved rate %d",
+                     premium_dscp, premium_rate);
+            update_premium_dscp(premium_dscp);
+        }
+    }
+
+    if (get_length(sync_bind)) {
+        if (sync_open(sync_bind))
+            exit(EXIT_FAILURE);
+        log_info("Syncing a fleet budget of %d with %d peers every %d sec",
+                 rate, nr_sync_peers, sync_interval);
+    }
+
+    /* Handle signals and exit clean */
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);
+    signal(SIGUSR1, restart_ramp);
+
+    while(1)
+    {
+        if (sync_fd >= 0) {
+            sleep(sync_interval);
+            elapsed += sync_interval;
+            sync_quota(rate, sync_timeout * RL_NANO,
+                       elapsed >= STATS_INTERVAL);
+            if (elapsed < STATS_INTERVAL)
+                continue;
+            elapsed = 0;
+        } else {
+            sleep(STATS_INTERVAL);
+        }
+        for (i = 0; i < nr_managed; i++) {
+            select_instance(&instances[i]);
+            if (shared_state)
+                log_info("Interfaces sharing their state:")
+            else
+                log_info("Interface %s:", instances[i].ifname)
+            /* Keep deleting the stale map entries periodically *
+             * TODO Check if LRU maps can be used.              */
+            delete_stale_entries();
+            if (max_concurrent)
+                sweep_connections(conn_idle_timeout * RL_NANO);
+            if (reputation || halfopen_max || max_concurrent)
+                log_port_stats();
+            if (redirect_ifindex || nr_redirect_cpus)
+                log_redirect_stats(nr_redirect_cpus);
+            log_proto_stats();
+            if (nr_classes)
+                log_class_stats();
+            if (fingerprint && fp_top > 0)
+                log_top_fingerprints(fp_top);
+            if (queue_stats)
+                log_queue_stats(&instances[i]);
+            if (hot_keys)
+                log_hot_keys(HOT_KEYS_TOP, 1);
+        }
+        log_cgroup_stats();
+        if (nr_workers)
+            log_worker_stats();
         fflush(info);
     }
 }
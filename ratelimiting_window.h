@@ -0,0 +1,60 @@
+// Copyright Contributors to the L3AF Project.
+// SPDX-License-Identifier: GPL-2.0
+
+/* Admission algorithms shared by the BPF programs and the user space
+ * limiters */
+
+#ifndef RATELIMITING_WINDOW_H
+#define RATELIMITING_WINDOW_H
+
+#include "ratelimiting_common.h"
+
+/* Sliding window decision over a two window state, cost is the amount the
+ * event adds to the window(1 for a packet, its length for bytes). Same
+ * weighting as rl_sliding_window, the state of a key fits in one value. */
+static __always_inline int rl_window_admit(struct rl_window *w, uint64_t tnow,
+                                           uint64_t limit, uint64_t cost)
+{
+    uint64_t start = tnow / RL_NANO * RL_NANO;
+
+    if (w->start != start)
+    {
+        /* Roll the windows, the previous one counts only when adjacent */
+        w->prev = w->start + RL_NANO == start ? w->curr : 0;
+        w->curr = 0;
+        w->start = start;
+    }
+
+    uint64_t pw_weight = 100 - ((tnow - start) * 100) / RL_NANO;
+    if (w->prev * pw_weight + w->curr * 100 > limit * 100)
+        return XDP_DROP;
+
+    __sync_fetch_and_add(&w->curr, cost);
+    return XDP_PASS;
+}
+
+/* GCRA decision over the theoretical arrival time(TAT) of the next
+ * conforming connection, 0 for a new key. A connection is admitted when it
+ * does not arrive earlier than TAT - tolerance and it then moves TAT
+ * forward by one emission interval.
+ * Compare-and-swap is not available to BPF programs on the kernels we
+ * support, so the check reads TAT once and the update is a single atomic
+ * add, concurrent SYNs of the same key can only over-admit by the number of
+ * CPUs racing on it. */
+static __always_inline int rl_gcra_admit(uint64_t *tat, uint64_t tnow,
+                                         uint64_t interval, uint64_t tolerance)
+{
+    if (*tat <= tnow)
+    {
+        /* Key has been idle for longer than an interval, restart from now */
+        *tat = tnow + interval;
+        return XDP_PASS;
+    }
+    if (*tat - tnow > tolerance)
+        return XDP_DROP;
+
+    __sync_fetch_and_add(tat, interval);
+    return XDP_PASS;
+}
+
+#endif